@@ -0,0 +1,535 @@
+#define _GNU_SOURCE //RUSAGE_THREAD
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ioctl.h"
+
+#define MAX_WORKERS	64
+#define MAX_IOVS	64
+#define MAX_SIZE	(1 << 20)
+#define MAX_SAMPLES	(1 << 20) /*Per worker, reservoir sampled past that */
+#define MIN_POLL_INTERVAL 1
+#define MAX_POLL_INTERVAL 10000
+
+enum { IO_BLOCK, IO_NONBLOCK, IO_VECTOR, IO_BATCH };
+
+static const char *io_names[] = {
+	[IO_BLOCK] = "block",
+	[IO_NONBLOCK] = "nonblock",
+	[IO_VECTOR] = "vector",
+	[IO_BATCH] = "batch",
+};
+
+struct bench_cfg {
+	const char *dev;
+	size_t size;
+	unsigned int writers;
+	unsigned int readers;
+	unsigned int io;
+	unsigned int iovs;
+	unsigned int batch;
+	unsigned int poll_ms;
+	unsigned int seconds;
+	unsigned int runs;
+	int packet;
+};
+
+//Start of every message, readers take the end to end latency from it
+struct bench_hdr {
+	uint64_t ns;
+	uint64_t seq;
+};
+
+struct bench_lat {
+	uint64_t *ns;
+	size_t nr;
+	uint64_t seen;
+	unsigned int seed;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	const struct bench_cfg *cfg;
+	int fd;
+	int reader;
+	volatile int done;
+	uint8_t *buf;
+	uint64_t msgs;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t retries;
+	struct bench_lat lat;
+	double user_s;//CPU time of the thread itself
+	double sys_s;
+};
+
+static volatile int stop;
+
+int usage(char **argv)
+{
+	printf("Program measures throughput and latency of a ddone device\n");
+	printf("Usage: %s [options] <device>\n", argv[0]);
+	printf("  -s <bytes>    Message size (default 256)\n");
+	printf("  -w <n>        Writer threads (default 1)\n");
+	printf("  -r <n>        Reader threads (default 1)\n");
+	printf("  -i <io>       block, nonblock, vector or batch (default block)\n");
+	printf("  -v <n>        iovecs per message for vector I/O (default 4)\n");
+	printf("  -b <n>        Messages per batch ioctl (default 16)\n");
+	printf("  -p <ms>       Device poll interval, 1 ~ 10000\n");
+	printf("  -t <seconds>  Run time (default 5)\n");
+	printf("  -n <runs>     Repeat, one result line each (default 1)\n");
+	printf("  -P            Packet mode, readers report end to end latency\n");
+	printf("Prints one JSON object per run\n");
+	return -1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double tv_secs(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//Thread CPU time, taken off when the worker starts and added when it ends
+static void bench_cpu(struct bench_worker *w, int sign)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	w->user_s += sign * tv_secs(ru.ru_utime);
+	w->sys_s += sign * tv_secs(ru.ru_stime);
+}
+
+static void lat_add(struct bench_lat *lat, uint64_t ns)
+{
+	uint64_t slot;
+
+	lat->seen++;
+	if (lat->nr < MAX_SAMPLES) {
+		lat->ns[lat->nr++] = ns;
+		return;
+	}
+	slot = ((uint64_t)rand_r(&lat->seed) << 31 | rand_r(&lat->seed)) %
+			lat->seen;
+	if (slot < MAX_SAMPLES)
+		lat->ns[slot] = ns;
+}
+
+//Nonblocking I/O spins, the device has no poll() support
+static int bench_again(struct bench_worker *w, ssize_t ret)
+{
+	if (ret >= 0 || errno != EAGAIN)
+		return 0;
+	w->retries++;
+	sched_yield();
+	return !stop;
+}
+
+static ssize_t bench_vector(struct bench_worker *w, int reader)
+{
+	const struct bench_cfg *cfg = w->cfg;
+	struct iovec iov[MAX_IOVS];
+	size_t part = cfg->size / cfg->iovs;
+	unsigned int i;
+
+	for (i = 0; i < cfg->iovs; i++) {
+		iov[i].iov_base = w->buf + i * part;
+		iov[i].iov_len = i == cfg->iovs - 1 ?
+				cfg->size - i * part : part;
+	}
+	return reader ? readv(w->fd, iov, cfg->iovs) :
+			writev(w->fd, iov, cfg->iovs);
+}
+
+//Returns messages done, lens gets the size of each for readers
+static ssize_t bench_batch(struct bench_worker *w, int reader,
+		uint32_t *lens)
+{
+	const struct bench_cfg *cfg = w->cfg;
+	struct ddone_msg msgs[DDONE_MAX_MSGS];
+	struct ddone_batch batch = {
+		.msgs = (uintptr_t)msgs,
+		.nr = cfg->batch,
+	};
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < cfg->batch; i++) {
+		msgs[i].buf = (uintptr_t)(w->buf + i * cfg->size);
+		msgs[i].len = cfg->size;
+		msgs[i].flags = 0;
+	}
+	ret = ioctl(w->fd, reader ? DDONE_RECV_BATCH : DDONE_SEND_BATCH,
+			&batch);
+	for (i = 0; reader && ret > 0 && i < (unsigned int)ret; i++)
+		lens[i] = msgs[i].len;
+	return ret;
+}
+
+static void bench_stamp(struct bench_worker *w, unsigned int nr)
+{
+	struct bench_hdr hdr;
+	unsigned int i;
+
+	if (w->cfg->size < sizeof(hdr))
+		return;
+	hdr.ns = now_ns();
+	for (i = 0; i < nr; i++) {
+		hdr.seq = w->msgs + i;
+		memcpy(w->buf + i * w->cfg->size, &hdr, sizeof(hdr));
+	}
+}
+
+static void *bench_writer(void *arg)
+{
+	struct bench_worker *w = arg;
+	const struct bench_cfg *cfg = w->cfg;
+	uint64_t start;
+	ssize_t ret;
+
+	bench_cpu(w, -1);
+	while (!stop) {
+		bench_stamp(w, cfg->io == IO_BATCH ? cfg->batch : 1);
+		start = now_ns();
+		do {
+			if (cfg->io == IO_BATCH)
+				ret = bench_batch(w, 0, NULL);
+			else if (cfg->io == IO_VECTOR)
+				ret = bench_vector(w, 0);
+			else
+				ret = write(w->fd, w->buf, cfg->size);
+		} while (bench_again(w, ret));
+		if (ret < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				w->errors++;
+			continue;
+		}
+		lat_add(&w->lat, now_ns() - start);
+		if (cfg->io == IO_BATCH) {
+			w->msgs += ret;
+			w->bytes += ret * cfg->size;
+		} else {
+			w->msgs++;
+			w->bytes += ret;
+		}
+	}
+	bench_cpu(w, 1);
+	w->done = 1;
+	return NULL;
+}
+
+/*
+ * In packet mode every record is one message and carries the writer's
+ * stamp. In stream mode the data is split anyhow, so the call time is all
+ * there is to measure.
+ */
+static void *bench_reader(void *arg)
+{
+	struct bench_worker *w = arg;
+	const struct bench_cfg *cfg = w->cfg;
+	uint32_t lens[DDONE_MAX_MSGS];
+	struct bench_hdr hdr;
+	uint64_t start, end;
+	unsigned int i, nr;
+	ssize_t ret;
+
+	bench_cpu(w, -1);
+	while (!stop) {
+		start = now_ns();
+		do {
+			if (cfg->io == IO_BATCH)
+				ret = bench_batch(w, 1, lens);
+			else if (cfg->io == IO_VECTOR)
+				ret = bench_vector(w, 1);
+			else
+				ret = read(w->fd, w->buf, cfg->size);
+		} while (bench_again(w, ret));
+		if (ret < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				w->errors++;
+			continue;
+		}
+		//Interrupted, or an empty record, neither is a message
+		if (!ret)
+			continue;
+		end = now_ns();
+
+		if (cfg->io == IO_BATCH) {
+			nr = ret;
+		} else {
+			nr = 1;
+			lens[0] = ret;
+		}
+		for (i = 0; i < nr; i++) {
+			w->bytes += lens[i];
+			if (!cfg->packet) {
+				w->msgs += lens[i] / cfg->size;
+				continue;
+			}
+			if (!lens[i])
+				continue;
+			w->msgs++;
+			if (lens[i] < sizeof(hdr))
+				continue;
+			memcpy(&hdr, w->buf + i * cfg->size, sizeof(hdr));
+			lat_add(&w->lat, end - hdr.ns);
+		}
+		if (!cfg->packet)
+			lat_add(&w->lat, end - start);
+	}
+	bench_cpu(w, 1);
+	w->done = 1;
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t pct(const uint64_t *v, size_t nr, double q)
+{
+	return nr ? v[(size_t)((nr - 1) * q)] : 0;
+}
+
+static void report_side(const char *name, struct bench_worker *w,
+		unsigned int nr, double secs, const char *lat_kind)
+{
+	uint64_t msgs = 0, bytes = 0, errors = 0, retries = 0;
+	size_t samples = 0, off = 0;
+	uint64_t *all;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		msgs += w[i].msgs;
+		bytes += w[i].bytes;
+		errors += w[i].errors;
+		retries += w[i].retries;
+		samples += w[i].lat.nr;
+	}
+	all = malloc((samples ? samples : 1) * sizeof(*all));
+	for (i = 0; all && i < nr; i++) {
+		memcpy(all + off, w[i].lat.ns, w[i].lat.nr * sizeof(*all));
+		off += w[i].lat.nr;
+	}
+	if (!all)
+		samples = 0;
+	qsort(all, samples, sizeof(*all), cmp_u64);
+
+	printf("\"%s\":{\"threads\":%u,\"msgs\":%llu,\"bytes\":%llu,"
+			"\"mb_s\":%.3f,\"msgs_s\":%.1f,\"errors\":%llu,"
+			"\"retries\":%llu,\"lat_kind\":\"%s\",\"lat_ns\":"
+			"{\"samples\":%zu,\"p50\":%llu,\"p99\":%llu,"
+			"\"p999\":%llu,\"max\":%llu}}",
+			name, nr, (unsigned long long)msgs,
+			(unsigned long long)bytes, bytes / secs / 1e6,
+			msgs / secs, (unsigned long long)errors,
+			(unsigned long long)retries, lat_kind, samples,
+			(unsigned long long)pct(all, samples, 0.5),
+			(unsigned long long)pct(all, samples, 0.99),
+			(unsigned long long)pct(all, samples, 0.999),
+			(unsigned long long)(samples ? all[samples - 1] : 0));
+	free(all);
+}
+
+//Blocked calls only return once interrupted, keep kicking until they see stop
+static void bench_join(struct bench_worker *w, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		while (!w[i].done) {
+			pthread_kill(w[i].thread, SIGUSR1);
+			usleep(10000);
+		}
+		pthread_join(w[i].thread, NULL);
+	}
+}
+
+static int bench_run(const struct bench_cfg *cfg, unsigned int run)
+{
+	struct bench_worker w[2 * MAX_WORKERS];
+	unsigned int i, nr = cfg->writers + cfg->readers;
+	double user = 0, sys = 0;
+	uint64_t start;
+	double secs;
+	int flags, err = 0;
+
+	memset(w, 0, sizeof(w));
+	flags = cfg->io == IO_NONBLOCK ? O_NONBLOCK : 0;
+	for (i = 0; i < nr; i++) {
+		w[i].cfg = cfg;
+		w[i].reader = i >= cfg->writers;
+		w[i].lat.seed = run * 2 * MAX_WORKERS + i + 1;
+		w[i].fd = open(cfg->dev, (w[i].reader ? O_RDONLY : O_WRONLY) |
+				flags);
+		w[i].buf = calloc(cfg->io == IO_BATCH ? cfg->batch : 1,
+				cfg->size);
+		w[i].lat.ns = malloc(MAX_SAMPLES * sizeof(uint64_t));
+		if (w[i].fd < 0 || !w[i].buf || !w[i].lat.ns) {
+			printf("Can't set up worker %u on %s\n", i, cfg->dev);
+			nr = i + 1;
+			err = -1;
+			goto out;
+		}
+	}
+
+	stop = 0;
+	start = now_ns();
+	//Readers first, so nothing the writers send goes unread
+	for (i = nr; i-- > 0;) {
+		if (pthread_create(&w[i].thread, NULL, w[i].reader ?
+					bench_reader : bench_writer, &w[i])) {
+			printf("Can't start worker %u\n", i);
+			stop = 1;
+			bench_join(w + i + 1, nr - i - 1);
+			err = -1;
+			goto out;
+		}
+	}
+	sleep(cfg->seconds);
+	stop = 1;
+	bench_join(w, nr);
+	secs = (now_ns() - start) / 1e9;
+	for (i = 0; i < nr; i++) {
+		user += w[i].user_s;
+		sys += w[i].sys_s;
+	}
+
+	printf("{\"run\":%u,\"device\":\"%s\",\"size\":%zu,\"io\":\"%s\","
+			"\"iovs\":%u,\"batch\":%u,\"mode\":\"%s\","
+			"\"poll_ms\":%u,\"seconds\":%.3f,",
+			run, cfg->dev, cfg->size, io_names[cfg->io],
+			cfg->io == IO_VECTOR ? cfg->iovs : 1,
+			cfg->io == IO_BATCH ? cfg->batch : 1,
+			cfg->packet ? "packet" : "stream", cfg->poll_ms, secs);
+	report_side("tx", w, cfg->writers, secs, "call");
+	printf(",");
+	report_side("rx", w + cfg->writers, cfg->readers, secs,
+			cfg->packet ? "e2e" : "call");
+	//Workers only, setup and the main thread are left out
+	printf(",\"cpu\":{\"user_s\":%.3f,\"sys_s\":%.3f,\"percent\":%.1f}}\n",
+			user, sys, (user + sys) / secs * 100);
+	fflush(stdout);
+out:
+	for (i = 0; i < nr; i++) {
+		if (w[i].fd > 0)
+			close(w[i].fd);
+		free(w[i].buf);
+		free(w[i].lat.ns);
+	}
+	return err;
+}
+
+static int parse_io(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(io_names) / sizeof(io_names[0]); i++) {
+		if (!strcmp(name, io_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+static void on_signal(int sig)
+{
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_cfg cfg = {
+		.size = 256,
+		.writers = 1,
+		.readers = 1,
+		.io = IO_BLOCK,
+		.iovs = 4,
+		.batch = 16,
+		.seconds = 5,
+		.runs = 1,
+	};
+	struct sigaction sa;
+	unsigned int run;
+	int opt, io, fd;
+
+	while ((opt = getopt(argc, argv, "s:w:r:i:v:b:p:t:n:P")) != -1) {
+		switch (opt) {
+		case 's': cfg.size = strtoul(optarg, NULL, 0); break;
+		case 'w': cfg.writers = atoi(optarg); break;
+		case 'r': cfg.readers = atoi(optarg); break;
+		case 'i':
+			io = parse_io(optarg);
+			if (io < 0)
+				return usage(argv);
+			cfg.io = io;
+			break;
+		case 'v': cfg.iovs = atoi(optarg); break;
+		case 'b': cfg.batch = atoi(optarg); break;
+		case 'p': cfg.poll_ms = atoi(optarg); break;
+		case 't': cfg.seconds = atoi(optarg); break;
+		case 'n': cfg.runs = atoi(optarg); break;
+		case 'P': cfg.packet = 1; break;
+		default: return usage(argv);
+		}
+	}
+	if (optind != argc - 1)
+		return usage(argv);
+	cfg.dev = argv[optind];
+
+	if (!cfg.size || cfg.size > MAX_SIZE ||
+			cfg.writers > MAX_WORKERS || cfg.readers > MAX_WORKERS ||
+			!cfg.iovs || cfg.iovs > MAX_IOVS || cfg.iovs > cfg.size ||
+			!cfg.batch || cfg.batch > DDONE_MAX_MSGS ||
+			!cfg.seconds || !cfg.runs ||
+			(cfg.poll_ms && (cfg.poll_ms < MIN_POLL_INTERVAL ||
+					 cfg.poll_ms > MAX_POLL_INTERVAL)))
+		return usage(argv);
+
+	//No SA_RESTART, so a signal gets blocked workers out of the driver
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	fd = open(cfg.dev, O_RDWR);
+	if (fd < 0) {
+		printf("file open error %s\n", cfg.dev);
+		return -1;
+	}
+	if (ioctl(fd, DDONE_SET_MODE, cfg.packet ? DDONE_MODE_PACKET :
+				DDONE_MODE_STREAM)) {
+		printf("Can't set mode, is the device busy?\n");
+		return -1;
+	}
+	if (cfg.poll_ms && ioctl(fd, DDONE_SET_POLL, cfg.poll_ms)) {
+		printf("Can't set poll interval\n");
+		return -1;
+	}
+
+	for (run = 0; run < cfg.runs; run++) {
+		if (bench_run(&cfg, run))
+			return -1;
+	}
+	close(fd);
+
+	return 0;
+}
@@ -73,9 +73,12 @@ struct platform_device *__init setup_device(struct resource *res)
 		err = -ENOMEM;
 		goto exit_err;
 	}
+#ifndef DDONE_EMULATE
+	//The emulator backs the windows with RAM, nothing to claim
 	err = platform_device_add_resources(pdev, res, 2);
 	if (err)
 		goto exit_free;
+#endif
 
 
 	err = platform_device_add(pdev);
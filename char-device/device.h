@@ -14,14 +14,32 @@
 #define REG_BASE2  0x60003000
 
 #define DATA_READY 1
+#define DATA_LZ4 2
+#define DATA_CRC 4
+#define CRC_SIZE 4
+#define DATA_SEQ 8
+#define SEQ_SIZE 4
+#define DATA_TX 16
 #define SIZE_REG 4
 #define FLAGS_REG 0
 
 //In flags register bit 0 indicates that device buffer is full
+//Bit 1 marks an LZ4 block, SIZE is its compressed length
+//Bit 2 means the last CRC_SIZE bytes of SIZE are a little endian CRC32C
+//(init and final xor ~0) of the bytes before them
+//Bit 3 marks a chunk of a striped stream, it starts with a little endian
+//u32 sequence number
+//Bit 4 marks a chunk pushed by the driver, the peer clears the flags once
+//it took it, chunks from the peer never have it
 
 int __init setup_devices(void);
 void remove_devices(void);
 
+#ifdef DDONE_EMULATE
+int ddone_emu_map(struct platform_device *pdev, void __iomem **mem,
+		void __iomem **regs);
+#endif
+
 
 
 
@@ -1,307 +1,2135 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/io_uring.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+#include <linux/lz4.h>
 #include "driver.h"
 
 unsigned int DEV_MAJOR;
 unsigned int DEV_MINOR;
 
-static ssize_t chardev_read(struct file *filp, char __user *buf, size_t count,
-		loff_t *f_pos);
-
+//Probed devices by minor, for forwarding
+static struct ddone_device *ddone_devs[DEVICE_COUNT];
+static DEFINE_MUTEX(ddone_devs_lock);
+static struct ddone_agg ddone_agg;
 
 static int     chardev_open(struct inode *inode, struct file *filep);
-static ssize_t chardev_read(struct file *filp, char __user *buf, size_t count,
-		loff_t *f_pos);
-static ssize_t chardev_write(struct file *filp, const char __user *buf,
-		size_t count, loff_t *f_pos);
+static int     chardev_release(struct inode *inode, struct file *filep);
+static loff_t  chardev_llseek(struct file *filp, loff_t offset, int whence);
+static ssize_t chardev_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t chardev_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static long    chardev_ioctl(struct file *filp, unsigned int cmd,
 		unsigned long arg);
+static int     chardev_uring_cmd(struct io_uring_cmd *ioucmd,
+		unsigned int issue_flags);
+
+static int     agg_open(struct inode *inode, struct file *filep);
+static ssize_t agg_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t agg_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static long    agg_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg);
 
 
 static int  device_remove(struct platform_device *pdev);
 static int  device_probe(struct platform_device *pdev);
 static void device_work_f(struct work_struct *work);
-static void device_try_write_to(struct ddone_device *ddev);
+static void device_try_write_to(struct ddone_device *ddev,
+		struct ddone_ring *ring);
 static void device_try_read_from(struct ddone_device *ddev);
+static int  device_cut_through(struct ddone_device *ddev,
+		struct iov_iter *from, size_t extra, bool nowait, size_t *done,
+		u64 *end);
+
+static u32  ddone_device_read_reg32(struct ddone_device *dev, u32 offset);
+static void ddone_device_write_reg32(struct ddone_device *dev, u32 offset,
+		u32 val);
+
+
+static struct platform_driver ddone_driver = {
+	.driver = {
+		.name = DEVICE_NAME,
+	},
+	.probe = device_probe,
+	.remove = device_remove
+};
+
+static const struct file_operations fops = {
+	.owner	= THIS_MODULE,
+	.read_iter	= chardev_read_iter,
+	.write_iter	= chardev_write_iter,
+	//Pipe pages go straight through the iter paths into/out of the ring
+	.splice_read	= copy_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.open	= chardev_open,
+	.release	= chardev_release,
+	.llseek	= chardev_llseek,
+	.unlocked_ioctl  = chardev_ioctl,
+	.uring_cmd	= chardev_uring_cmd
+};
+
+static const struct file_operations agg_fops = {
+	.owner	= THIS_MODULE,
+	.read_iter	= agg_read_iter,
+	.write_iter	= agg_write_iter,
+	.open	= agg_open,
+	.unlocked_ioctl  = agg_ioctl
+};
+
+static u32 ddone_device_read_reg32(struct ddone_device *dev, u32 offset)
+{
+	return ioread32(dev->regs + offset);
+}
+static void ddone_device_write_reg32(struct ddone_device *dev, u32 offset,
+		u32 val)
+{
+	iowrite32(val, dev->regs+offset);
+}
+
+static bool chardev_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_flags & IOCB_NOWAIT) ||
+		(iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+static int chardev_lock(struct mutex *mutex, struct kiocb *iocb)
+{
+	if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+		mutex_lock(mutex);
+		return 0;
+	}
+	return mutex_trylock(mutex) ? 0 : -EAGAIN;
+}
+
+//Largest record a write may queue, sealed chunks lose room to the trailer
+static size_t chardev_max_record(struct ddone_device *ddev)
+{
+	return MEM_SIZE - (READ_ONCE(ddev->tx_crc) ? CRC_SIZE : 0);
+}
+
+/*
+ * IOCB_NOWAIT: the user copy goes to a bounce buffer with page faults off,
+ * and only a ring with no reservation in flight is taken, so the commit
+ * does not wait either. A stream write may go in short, a record goes in
+ * whole or not at all.
+ */
+static int chardev_queue_nowait(struct ddone_ring *ring,
+		struct iov_iter *from, bool packet, size_t *done, u64 *end)
+{
+	struct ddone_rec_hdr hdr;
+	size_t len, total, copied;
+	void *bounce;
+	u64 pos;
+	int err;
+
+	len = min_t(size_t, iov_iter_count(from), BUF_SIZE);
+	bounce = kmalloc(len, GFP_NOWAIT);
+	if (!bounce)
+		return -EAGAIN;
+
+	pagefault_disable();
+	copied = copy_from_iter(bounce, len, from);
+	pagefault_enable();
+	if (!copied || (packet && copied != len)) {
+		iov_iter_revert(from, copied);
+		err = -EAGAIN;
+		goto out;
+	}
+
+	total = copied + (packet ? sizeof(hdr) : 0);
+	err = ring_try_reserve(ring, packet ? total : 1, &total, &pos);
+	if (err) {
+		iov_iter_revert(from, copied);
+		goto out;
+	}
+
+	if (packet) {
+		hdr.len = copied;
+		hdr.flags = 0;
+		ring_copy_in(ring, pos, &hdr, sizeof(hdr));
+		ring_copy_in(ring, pos + sizeof(hdr), bounce, copied);
+	} else {
+		//Got less room than was copied, the rest stays in the iter
+		iov_iter_revert(from, copied - total);
+		copied = total;
+		ring_copy_in(ring, pos, bounce, copied);
+	}
+	ring_commit(ring, pos, total);
+
+	*done += copied;
+	*end = pos + total;
+out:
+	kfree(bounce);
+	return err;
+}
+
+/*
+ * Copies the whole iter into the TX ring. Each span is reserved, filled
+ * without locks and committed, so writers only serialize on the commit.
+ */
+static int chardev_queue_stream(struct ddone_device *ddev,
+		struct ddone_ring *ring, struct iov_iter *from, bool nonblock,
+		bool nowait, size_t *done, u64 *end)
+{
+	size_t count, copied;
+	u64 pos;
+	int err;
+
+	if (ring == &ddev->tx) {
+		err = device_cut_through(ddev, from, 0, nowait, done, end);
+		if (err)
+			return err;
+	}
+	if (nowait)
+		return iov_iter_count(from) ?
+			chardev_queue_nowait(ring, from, false, done, end) : 0;
+
+	while (iov_iter_count(from)) {
+		//Only reserve what is mapped, a partly bad buffer writes short
+		count = min_t(size_t, iov_iter_count(from), BUF_SIZE);
+		count -= fault_in_iov_iter_readable(from, count);
+		if (!count)
+			return -EFAULT;
+
+		err = ring_reserve(ring, 1, &count, &pos, nonblock);
+		if (err)
+			return err;
+
+		copied = ring_copy_from_iter(ring, pos, count, from);
+		//Only a racing munmap gets here, the space has to be committed
+		if (copied != count)
+			ring_fill(ring, pos + copied, 0, count - copied);
+		ring_commit(ring, pos, count);
+
+		*done += copied;
+		*end = pos + count;
+		if (copied != count)
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+//Packet mode: the whole iter becomes one record and one window chunk
+static int chardev_queue_record(struct ddone_device *ddev,
+		struct ddone_ring *ring, struct iov_iter *from, bool nonblock,
+		bool nowait, size_t *done, u64 *end)
+{
+	struct ddone_rec_hdr hdr;
+	size_t len, total, copied;
+	u64 pos;
+	int err;
+
+	len = iov_iter_count(from);
+	if (len > chardev_max_record(ddev))
+		return -EMSGSIZE;
+	if (!len)//Empty chunk means end of stream to the peer
+		return 0;
+
+	if (ring == &ddev->tx) {
+		err = device_cut_through(ddev, from, sizeof(hdr), nowait, done,
+				end);
+		if (err || !iov_iter_count(from))
+			return err;
+	}
+	if (nowait)
+		return chardev_queue_nowait(ring, from, true, done, end);
+
+	if (fault_in_iov_iter_readable(from, len))
+		return -EFAULT;
+
+	total = sizeof(hdr) + len;
+	err = ring_reserve(ring, total, &total, &pos, nonblock);
+	if (err)
+		return err;
+
+	hdr.len = len;
+	hdr.flags = 0;
+	ring_copy_in(ring, pos, &hdr, sizeof(hdr));
+	copied = ring_copy_from_iter(ring, pos + sizeof(hdr), len, from);
+	if (copied != len)
+		ring_fill(ring, pos + sizeof(hdr) + copied, 0,
+				len - copied);
+	ring_commit(ring, pos, total);
+
+	*done += copied;
+	*end = pos + total;
+
+	return copied == len ? 0 : -EFAULT;
+}
+
+static int chardev_queue_to(struct ddone_device *ddev,
+		struct ddone_ring *ring, struct iov_iter *from, bool nonblock,
+		bool nowait, size_t *done, u64 *end)
+{
+	if (READ_ONCE(ddev->packet))
+		return chardev_queue_record(ddev, ring, from, nonblock, nowait,
+				done, end);
+	return chardev_queue_stream(ddev, ring, from, nonblock, nowait, done,
+			end);
+}
+
+static int chardev_queue(struct ddone_device *ddev, struct iov_iter *from,
+		bool nonblock, size_t *done, u64 *end)
+{
+	return chardev_queue_to(ddev, &ddev->tx, from, nonblock, false, done,
+			end);
+}
+
+//Lets everything queued up to end skip coalescing and kicks the worker
+static void chardev_tx_flush(struct ddone_device *ddev, u64 end)
+{
+	spin_lock(&ddev->tx.lock);
+	ddev->tx_flush = max(ddev->tx_flush, end);
+	spin_unlock(&ddev->tx.lock);
+
+	mod_delayed_work(ddev->device_wq, &ddev->dwork, 0);
+}
+
+static ssize_t chardev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ddone_file *dfile = iocb->ki_filp->private_data;
+	struct ddone_device *ddev = dfile->ddev;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct ddone_ring *lane;
+	size_t done;
+	u64 end;
+	int err;
+
+	done = 0;
+	if (!nowait)
+		down_read(&ddev->mode_sem);
+	else if (!down_read_trylock(&ddev->mode_sem))
+		return -EAGAIN;
+	lane = smp_load_acquire(&dfile->lane);
+	if (lane) {
+		//Offsets in a lane mean nothing to flushing, just wake the worker
+		err = chardev_queue_to(ddev, lane, from,
+				chardev_nonblock(iocb), nowait, &done, &end);
+		up_read(&ddev->mode_sem);
+		iocb->ki_pos += done;
+		if (done)
+			mod_delayed_work(ddev->device_wq, &ddev->dwork, 0);
+		return done ? done : err;
+	}
+
+	err = chardev_queue_to(ddev, &ddev->tx, from, chardev_nonblock(iocb),
+			nowait, &done, &end);
+	up_read(&ddev->mode_sem);
+	iocb->ki_pos += done;
+	//Per write push now flag
+	if (done && (iocb->ki_flags & IOCB_DSYNC))
+		chardev_tx_flush(ddev, end);
+
+	return done ? done : err;
+}
+
+static struct ddone_uring_pdu *chardev_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct ddone_uring_pdu) > sizeof(ioucmd->pdu));
+	return (struct ddone_uring_pdu *)ioucmd->pdu;
+}
+
+static void chardev_uring_done(struct io_uring_cmd *ioucmd,
+		unsigned int issue_flags)
+{
+	io_uring_cmd_done(ioucmd, chardev_uring_pdu(ioucmd)->res, 0,
+			issue_flags);
+}
+
+/*
+ * Parks the command until target TX bytes were pushed to the window. It is
+ * cancelable from the start, so ring teardown never waits on the device.
+ * Marking takes the ring lock, which cancel holds when it takes ours.
+ */
+static int chardev_uring_park(struct ddone_device *ddev,
+		struct io_uring_cmd *ioucmd, u64 target, s64 res,
+		unsigned int issue_flags)
+{
+	struct ddone_uring_pdu *pdu = chardev_uring_pdu(ioucmd);
+
+	//Cancel may look at the node as soon as it is marked
+	INIT_LIST_HEAD(&pdu->node);
+	io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+
+	mutex_lock(&ddev->mutex);
+	if (ddev->tx.rpos >= target) {
+		mutex_unlock(&ddev->mutex);
+		io_uring_cmd_done(ioucmd, res, 0, issue_flags);
+		return -EIOCBQUEUED;
+	}
+
+	pdu->target = target;
+	pdu->res = res;
+	list_add_tail(&pdu->node, &ddev->tx_waiters);
+	mutex_unlock(&ddev->mutex);
+
+	return -EIOCBQUEUED;
+}
+
+//Ring teardown, the command may already be on its way to completion
+static void chardev_uring_cancel(struct ddone_device *ddev,
+		struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct ddone_uring_pdu *pdu = chardev_uring_pdu(ioucmd);
+	bool parked;
+
+	mutex_lock(&ddev->mutex);
+	parked = !list_empty(&pdu->node);
+	list_del_init(&pdu->node);
+	mutex_unlock(&ddev->mutex);
+
+	if (parked)
+		io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+}
+
+//Completes parked commands covered by the TX ring consumer, or all with err
+static void chardev_uring_complete(struct ddone_device *ddev, int err)
+{
+	struct ddone_uring_pdu *pdu, *tmp;
+	struct io_uring_cmd *ioucmd;
+
+	list_for_each_entry_safe(pdu, tmp, &ddev->tx_waiters, node) {
+		if (!err && pdu->target > ddev->tx.rpos)
+			continue;
+		list_del_init(&pdu->node);
+		if (err)
+			pdu->res = err;
+		ioucmd = container_of((void *)pdu, struct io_uring_cmd, pdu);
+		io_uring_cmd_complete_in_task(ioucmd, chardev_uring_done);
+	}
+}
+
+//Queues the batch as one reservation, so it is taken in full or not at all
+static int chardev_queue_all(struct ddone_device *ddev,
+		struct ddone_msg *msgs, u32 nr, size_t total, u64 *end)
+{
+	struct ddone_rec_hdr hdr;
+	struct iov_iter iter;
+	size_t off, copied;
+	bool packet;
+	u64 pos;
+	u32 i;
+	int err;
+
+	packet = READ_ONCE(ddev->packet);
+	if (packet)
+		total += nr * sizeof(hdr);
+
+	for (i = 0; i < nr; i++) {
+		err = import_ubuf(ITER_SOURCE, u64_to_user_ptr(msgs[i].buf),
+				msgs[i].len, &iter);
+		if (err)
+			return err;
+		if (fault_in_iov_iter_readable(&iter, msgs[i].len))
+			return -EFAULT;
+	}
+
+	err = ring_reserve(&ddev->tx, total, &total, &pos, true);
+	if (err)
+		return err;
+
+	off = 0;
+	for (i = 0; i < nr; i++) {
+		if (packet) {
+			hdr.len = msgs[i].len;
+			hdr.flags = 0;
+			ring_copy_in(&ddev->tx, pos + off, &hdr, sizeof(hdr));
+			off += sizeof(hdr);
+		}
+		import_ubuf(ITER_SOURCE, u64_to_user_ptr(msgs[i].buf),
+				msgs[i].len, &iter);
+		copied = ring_copy_from_iter(&ddev->tx, pos + off,
+				msgs[i].len, &iter);
+		if (copied != msgs[i].len) {
+			ring_fill(&ddev->tx, pos + off + copied, 0,
+					msgs[i].len - copied);
+			err = -EFAULT;
+		}
+		off += msgs[i].len;
+	}
+	ring_commit(&ddev->tx, pos, total);
+	*end = pos + total;
+
+	return err;
+}
+
+/*
+ * Queues a batch of messages, returns how many were queued in full. Without
+ * blocking io_uring needs the whole batch to fit (atomic), as it replays
+ * all of it in blocking mode on -EAGAIN. Otherwise whole messages are
+ * queued until the ring is full.
+ */
+static int chardev_queue_msgs_locked(struct ddone_device *ddev,
+		struct ddone_msg *msgs, u32 nr, bool nonblock, bool atomic,
+		size_t *done, u64 *end)
+{
+	struct iov_iter iter;
+	size_t total;
+	u32 i;
+	int err;
+
+	total = 0;
+	for (i = 0; i < nr; i++) {
+		//Every message is one record that has to fit the window
+		if (READ_ONCE(ddev->packet) && !msgs[i].len)
+			return -EINVAL;
+		if (READ_ONCE(ddev->packet) &&
+				msgs[i].len > chardev_max_record(ddev))
+			return -EMSGSIZE;
+		total += msgs[i].len;
+	}
+	if (!total)
+		return nr;
+
+	if (nonblock && atomic) {
+		err = chardev_queue_all(ddev, msgs, nr, total, end);
+		if (err)//Too big for the ring is fine once blocking
+			return err == -EMSGSIZE ? -EAGAIN : err;
+		*done += total;
+		return nr;
+	}
+
+	for (i = 0; nonblock && i < nr; i++) {
+		if (!msgs[i].len)
+			continue;
+		err = chardev_queue_all(ddev, &msgs[i], 1, msgs[i].len, end);
+		if (err)
+			return i ? i : err;
+		*done += msgs[i].len;
+	}
+	if (nonblock)
+		return nr;
+
+	for (i = 0; i < nr; i++) {
+		err = import_ubuf(ITER_SOURCE, u64_to_user_ptr(msgs[i].buf),
+				msgs[i].len, &iter);
+		if (!err)
+			err = chardev_queue(ddev, &iter, false, done, end);
+		if (err)
+			return i ? i : err;
+	}
+
+	return nr;
+}
+
+static int chardev_queue_msgs(struct ddone_device *ddev,
+		struct ddone_msg *msgs, u32 nr, bool nonblock, bool atomic,
+		size_t *done, u64 *end)
+{
+	int ret;
+
+	down_read(&ddev->mode_sem);
+	ret = chardev_queue_msgs_locked(ddev, msgs, nr, nonblock, atomic,
+			done, end);
+	up_read(&ddev->mode_sem);
+
+	return ret;
+}
+
+static int chardev_uring_submit(struct ddone_device *ddev,
+		struct io_uring_cmd *ioucmd, u64 addr, u32 nr, u32 flags,
+		unsigned int issue_flags)
+{
+	bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+	struct ddone_msg *msgs;
+	size_t done;
+	u64 end;
+	int err;
+
+	if (!nr || nr > DDONE_MAX_MSGS)
+		return -EINVAL;
+
+	msgs = memdup_user(u64_to_user_ptr(addr), nr * sizeof(*msgs));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	done = 0;
+	err = chardev_queue_msgs(ddev, msgs, nr, nonblock, true, &done,
+			&end);
+	kfree(msgs);
+
+	if (done && (flags & DDONE_URING_F_PUSHED))
+		return chardev_uring_park(ddev, ioucmd, end, done,
+				issue_flags);
+
+	return done || err >= 0 ? done : err;
+}
+
+static int chardev_uring_cmd(struct io_uring_cmd *ioucmd,
+		unsigned int issue_flags)
+{
+	struct ddone_file *dfile = ioucmd->file->private_data;
+	struct ddone_device *ddev = dfile->ddev;
+	const struct ddone_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+	u64 arg = READ_ONCE(cmd->arg);
+	u32 nr = READ_ONCE(cmd->nr);
+	u32 flags = READ_ONCE(cmd->flags);
+	u64 head;
+
+	if (issue_flags & IO_URING_F_CANCEL) {
+		chardev_uring_cancel(ddev, ioucmd, issue_flags);
+		return 0;
+	}
+	if (flags & ~DDONE_URING_F_PUSHED)
+		return -EINVAL;
+
+	switch (ioucmd->cmd_op) {
+	case DDONE_URING_CMD_SUBMIT:
+		return chardev_uring_submit(ddev, ioucmd, arg, nr, flags,
+				issue_flags);
+	case DDONE_URING_CMD_TX_WAIT:
+		//Zero waits for everything queued so far, nothing past that
+		spin_lock(&ddev->tx.lock);
+		head = ddev->tx.head;
+		spin_unlock(&ddev->tx.lock);
+		if (arg > head)
+			return -EINVAL;
+		return chardev_uring_park(ddev, ioucmd, arg ? arg : head, 0,
+				issue_flags);
+	default:
+		return -ENOTTY;
+	}
+}
+
+//Where the file reads next, the shared ring consumer unless in fan-out mode
+static u64 chardev_rx_pos(struct ddone_file *dfile)
+{
+	struct ddone_device *ddev = dfile->ddev;
+
+	return READ_ONCE(ddev->fanout) ? dfile->rpos : ddev->rx.rpos;
+}
+
+static size_t chardev_rx_avail(struct ddone_file *dfile)
+{
+	struct ddone_ring *rx = &dfile->ddev->rx;
+	size_t avail;
+
+	spin_lock(&rx->lock);
+	avail = rx->tail - chardev_rx_pos(dfile);
+	spin_unlock(&rx->lock);
+
+	return avail;
+}
+
+//Frees what every reader is done with, read_mutex held
+static void chardev_rx_reclaim(struct ddone_device *ddev)
+{
+	struct ddone_file *dfile;
+	u64 min;
+
+	//Nobody to hand it to, keep it for the next reader
+	if (list_empty(&ddev->readers))
+		return;
+
+	min = U64_MAX;
+	list_for_each_entry(dfile, &ddev->readers, node)
+		min = min(min, dfile->rpos);
+	if (min > ddev->rx.rpos)
+		ring_consume(&ddev->rx, min - ddev->rx.rpos);
+}
+
+static void chardev_rx_advance(struct ddone_file *dfile, size_t count)
+{
+	struct ddone_device *ddev = dfile->ddev;
+
+	if (!ddev->fanout) {
+		ring_consume(&ddev->rx, count);
+		return;
+	}
+
+	spin_lock(&ddev->rx.lock);
+	dfile->rpos += count;
+	spin_unlock(&ddev->rx.lock);
+	chardev_rx_reclaim(ddev);
+}
+
+//Not for users: a nofault copy came up short and nothing was taken
+#define DDONE_MSG_FAULT (1U << 31)
+
+/*
+ * Packet mode: hands out one record, the part that does not fit is dropped.
+ * With DDONE_SET_TSTAMP the record is preceded by struct ddone_rx_info.
+ */
+static size_t chardev_read_record(struct ddone_file *dfile,
+		struct iov_iter *to, u32 *flags, struct ddone_stamp *stamp,
+		bool nofault)
+{
+	struct ddone_device *ddev = dfile->ddev;
+	struct ddone_rx_hdr hdr;
+	struct ddone_rx_info info;
+	size_t copied, ret, want;
+	u64 pos;
+
+	pos = chardev_rx_pos(dfile);
+	ring_copy_out(&ddev->rx, pos, &hdr, sizeof(hdr));
+	*flags = hdr.rec.flags;
+	if (stamp) {
+		stamp->ts = hdr.ts;
+		stamp->ts_raw = hdr.ts_raw;
+	}
+
+	ret = 0;
+	want = (ddev->rx_tstamp ? sizeof(info) : 0) + hdr.rec.len;
+	want = min_t(size_t, want, iov_iter_count(to));
+	if (ddev->rx_tstamp) {
+		info.ts = hdr.ts;
+		info.ts_raw = hdr.ts_raw;
+		info.len = hdr.rec.len;
+		info.flags = hdr.rec.flags;
+		ret = copy_to_iter(&info, sizeof(info), to);
+	}
+
+	copied = ring_copy_to_iter(&ddev->rx, pos + sizeof(hdr),
+			min_t(size_t, hdr.rec.len, iov_iter_count(to)), to);
+	//The record stays for a retry that may fault
+	if (nofault && ret + copied != want) {
+		iov_iter_revert(to, ret + copied);
+		*flags = DDONE_MSG_FAULT;
+		return 0;
+	}
+	chardev_rx_advance(dfile, sizeof(hdr) + hdr.rec.len);
+
+	if (copied < hdr.rec.len)
+		*flags |= DDONE_MSG_TRUNC;
+	return ret + copied;
+}
+
+/*
+ * Hands out one record, or as much of the stream as fits, read_mutex held.
+ * With nofault the caller disabled page faults, see DDONE_MSG_FAULT.
+ */
+static size_t chardev_read_one(struct ddone_file *dfile,
+		struct iov_iter *to, u32 *flags, struct ddone_stamp *stamp,
+		bool nofault)
+{
+	struct ddone_device *ddev = dfile->ddev;
+	size_t count, copied;
+
+	if (ddev->rx_packet)
+		return chardev_read_record(dfile, to, flags, stamp, nofault);
+
+	count = min(chardev_rx_avail(dfile), iov_iter_count(to));
+	copied = ring_copy_to_iter(&ddev->rx, chardev_rx_pos(dfile), count,
+			to);
+	if (nofault && count && !copied) {
+		*flags = DDONE_MSG_FAULT;
+		return 0;
+	}
+	chardev_rx_advance(dfile, copied);
+
+	*flags = 0;
+	if (stamp)//Chunk boundaries and their times are lost in a stream
+		memset(stamp, 0, sizeof(*stamp));
+	return copied;
+}
+
+//Waits for RX data and returns with read_mutex held
+static int chardev_read_lock(struct ddone_file *dfile, bool nonblock,
+		bool nowait)
+{
+	struct ddone_device *ddev = dfile->ddev;
+	int err;
+
+	for (;;) {
+		if (!chardev_rx_avail(dfile)) {
+			if (nonblock)
+				return -EAGAIN;
+			err = wait_event_interruptible(ddev->rx.rq,
+					chardev_rx_avail(dfile));
+			if (err)
+				return err;
+		}
+
+		//Readers take turns on the RX ring
+		if (!nowait)
+			mutex_lock(&ddev->read_mutex);
+		else if (!mutex_trylock(&ddev->read_mutex))
+			return -EAGAIN;
+		if (chardev_rx_avail(dfile))
+			return 0;
+		//Another reader was faster
+		mutex_unlock(&ddev->read_mutex);
+	}
+}
+
+static size_t chardev_hist_copy(struct ddone_device *ddev, u64 pos,
+		size_t count, struct iov_iter *to)
+{
+	size_t off = pos & (ddev->hist_size - 1);
+	size_t first = min_t(size_t, count, ddev->hist_size - off);
+	size_t copied;
+
+	copied = copy_to_iter(ddev->hist + off, first, to);
+	if (copied == first && count > first)
+		copied += copy_to_iter(ddev->hist, count - first, to);
+
+	return copied;
+}
+
+//Waits for RX payload past pos, returns with hist_sem held for reading
+static int chardev_hist_lock(struct ddone_device *ddev, u64 pos,
+		bool nonblock, bool nowait)
+{
+	int err;
+
+	for (;;) {
+		if (!nowait)
+			down_read(&ddev->hist_sem);
+		else if (!down_read_trylock(&ddev->hist_sem))
+			return -EAGAIN;
+		if (!ddev->hist) {
+			up_read(&ddev->hist_sem);
+			return -ENODATA;
+		}
+		if (smp_load_acquire(&ddev->hist_tail) > pos)
+			return 0;
+		up_read(&ddev->hist_sem);
+
+		if (nonblock)
+			return -EAGAIN;
+		err = wait_event_interruptible(ddev->rx.rq,
+				READ_ONCE(ddev->hist_tail) > pos ||
+				!READ_ONCE(ddev->hist));
+		if (err)
+			return err;
+	}
+}
+
+//Replays retained RX payload at ki_pos, the ring is left alone
+static ssize_t chardev_read_history(struct kiocb *iocb, struct iov_iter *to)
+{
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct ddone_device *ddev;
+	size_t count, copied;
+	u64 pos, tail;
+	int err;
+
+	ddev = ((struct ddone_file *)iocb->ki_filp->private_data)->ddev;
+	pos = iocb->ki_pos;
+
+	err = chardev_hist_lock(ddev, pos, chardev_nonblock(iocb), nowait);
+	if (err == -ERESTARTSYS)
+		return 0;//Return 0 count to indicate end of stream
+	if (err)
+		return err;
+
+	tail = smp_load_acquire(&ddev->hist_tail);
+	if (pos < ddev->hist_start || tail - pos > ddev->hist_size) {
+		err = -ENODATA;
+		goto out;
+	}
+
+	count = min_t(size_t, tail - pos, iov_iter_count(to));
+	if (nowait)
+		pagefault_disable();
+	copied = chardev_hist_copy(ddev, pos, count, to);
+	if (nowait)
+		pagefault_enable();
+
+	//The worker may have lapped us while we were copying
+	smp_rmb();
+	if (READ_ONCE(ddev->hist_head) > pos + ddev->hist_size) {
+		err = -ENODATA;
+		goto out;
+	}
+	iocb->ki_pos += copied;
+	err = copied ? copied : nowait ? -EAGAIN : -EFAULT;
+out:
+	up_read(&ddev->hist_sem);
+	return err;
+}
+
+static ssize_t chardev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct ddone_file *dfile;
+	size_t copied;
+	bool packet;
+	u32 flags;
+	int err;
+
+	dfile = iocb->ki_filp->private_data;
+	if (!iov_iter_count(to))
+		return 0;
+	if (READ_ONCE(dfile->history))
+		return chardev_read_history(iocb, to);
+
+	err = chardev_read_lock(dfile, chardev_nonblock(iocb), nowait);
+	if (err == -ERESTARTSYS)
+		return 0;//Return 0 count to indicate end of stream
+	if (err)
+		return err;
+
+	//No chunk boundaries in a stream, so a bad chunk fails one read
+	if (!dfile->ddev->rx_packet &&
+			dfile->crc_errors != READ_ONCE(dfile->ddev->crc_errors)) {
+		dfile->crc_errors = READ_ONCE(dfile->ddev->crc_errors);
+		mutex_unlock(&dfile->ddev->read_mutex);
+		return -EBADMSG;
+	}
+
+	//IOCB_NOWAIT takes what the pages already in can hold, or nothing
+	packet = dfile->ddev->rx_packet;
+	if (nowait)
+		pagefault_disable();
+	copied = chardev_read_one(dfile, to, &flags, NULL, nowait);
+	if (nowait)
+		pagefault_enable();
+	iocb->ki_pos += copied;
+	mutex_unlock(&dfile->ddev->read_mutex);
+
+	if (flags & DDONE_MSG_FAULT)
+		return -EAGAIN;
+	if (flags & DDONE_MSG_BADCRC)
+		return -EBADMSG;
+	//An empty record is the peer's end of stream, nothing was lost
+	if (!copied && packet && !(flags & DDONE_MSG_TRUNC))
+		return 0;
+	return copied ? copied : -EFAULT;
+
+}
+
+/*
+ * recvmmsg() style: waits for the first record only, then fills as many
+ * entries as there are records buffered.
+ */
+static long chardev_recv_batch(struct file *filp,
+		struct ddone_batch __user *ubatch)
+{
+	struct ddone_file *dfile = filp->private_data;
+	struct ddone_stamp *stamps = NULL;
+	struct ddone_batch batch;
+	struct ddone_msg *msgs;
+	struct iov_iter iter;
+	u32 i;
+	long err;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	//A file that seeked into history left the ring, read() serves it
+	if (READ_ONCE(dfile->history))
+		return -EINVAL;
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.nr || batch.nr > DDONE_MAX_MSGS)
+		return -EINVAL;
+
+	msgs = memdup_user(u64_to_user_ptr(batch.msgs),
+			batch.nr * sizeof(*msgs));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	if (batch.stamps) {
+		stamps = kcalloc(batch.nr, sizeof(*stamps), GFP_KERNEL);
+		if (!stamps) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	err = chardev_read_lock(dfile, filp->f_flags & O_NONBLOCK, false);
+	if (err)
+		goto out;
+
+	for (i = 0; i < batch.nr && chardev_rx_avail(dfile); i++) {
+		err = import_ubuf(ITER_DEST, u64_to_user_ptr(msgs[i].buf),
+				msgs[i].len, &iter);
+		if (err)
+			break;
+		msgs[i].len = chardev_read_one(dfile, &iter, &msgs[i].flags,
+				stamps ? &stamps[i] : NULL, false);
+	}
+	mutex_unlock(&dfile->ddev->read_mutex);
+
+	if (!i)
+		goto out;
+	err = i;
+	if (copy_to_user(u64_to_user_ptr(batch.msgs), msgs,
+				i * sizeof(*msgs)) ||
+			(stamps && copy_to_user(u64_to_user_ptr(batch.stamps),
+				stamps, i * sizeof(*stamps))) ||
+			put_user(i, &ubatch->nr))
+		err = -EFAULT;
+out:
+	kfree(stamps);
+	kfree(msgs);
+	return err;
+}
+
+static long chardev_send_batch(struct file *filp,
+		struct ddone_batch __user *ubatch)
+{
+	struct ddone_device *ddev;
+	struct ddone_batch batch;
+	struct ddone_msg *msgs;
+	size_t done;
+	u64 end;
+	long err;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.nr || batch.nr > DDONE_MAX_MSGS)
+		return -EINVAL;
+
+	msgs = memdup_user(u64_to_user_ptr(batch.msgs),
+			batch.nr * sizeof(*msgs));
+	if (IS_ERR(msgs))
+		return PTR_ERR(msgs);
+
+	ddev = ((struct ddone_file *)filp->private_data)->ddev;
+	done = 0;
+	err = chardev_queue_msgs(ddev, msgs, batch.nr,
+			filp->f_flags & O_NONBLOCK, false, &done, &end);
+	kfree(msgs);
+
+	if (err > 0 && put_user((u32)err, &ubatch->nr))
+		err = -EFAULT;
+	return err;
+}
+
+static bool chardev_lanes_empty(struct ddone_device *ddev)
+{
+	struct ddone_file *dfile;
+	int prio;
+
+	for (prio = 0; prio < DDONE_PRIO_COUNT; prio++) {
+		list_for_each_entry(dfile, &ddev->lanes[prio], lane_node) {
+			if (ring_space(dfile->lane) != BUF_SIZE)
+				return false;
+		}
+	}
+	return true;
+}
+
+//Record framing changes the ring layout, so all rings have to be empty
+static long chardev_set_mode(struct ddone_device *ddev, unsigned long mode)
+{
+	long err = 0;
+
+	if (mode != DDONE_MODE_STREAM && mode != DDONE_MODE_PACKET)
+		return -EINVAL;
+
+	//A writer in flight may have framed by the old mode and not reserved yet
+	if (!down_write_trylock(&ddev->mode_sem))
+		return -EBUSY;
+	mutex_lock(&ddev->mutex);
+	if (!chardev_lanes_empty(ddev)) {
+		mutex_unlock(&ddev->mutex);
+		up_write(&ddev->mode_sem);
+		return -EBUSY;
+	}
+	mutex_lock(&ddev->read_mutex);
+	spin_lock(&ddev->tx.lock);
+	spin_lock(&ddev->rx.lock);
+	if (ddev->tx.head != ddev->tx.rpos || ddev->rx.head != ddev->rx.rpos ||
+			ddev->mem_offset) {
+		err = -EBUSY;
+	} else {
+		WRITE_ONCE(ddev->packet, mode == DDONE_MODE_PACKET);
+		ddev->rx_packet = ddev->packet;
+	}
+	spin_unlock(&ddev->rx.lock);
+	spin_unlock(&ddev->tx.lock);
+	mutex_unlock(&ddev->read_mutex);
+	mutex_unlock(&ddev->mutex);
+	up_write(&ddev->mode_sem);
+
+	return err;
+}
+
+/*
+ * Packet records were sized without the trailer, so sealing only comes on
+ * once none are queued. Writers in flight may have checked the old size.
+ */
+static long chardev_set_crc(struct ddone_device *ddev, unsigned long on)
+{
+	long err = 0;
+
+	if (!on) {
+		mutex_lock(&ddev->mutex);
+		WRITE_ONCE(ddev->tx_crc, false);
+		mutex_unlock(&ddev->mutex);
+		return 0;
+	}
+
+	if (!down_write_trylock(&ddev->mode_sem))
+		return -EBUSY;
+	mutex_lock(&ddev->mutex);
+	if (ddev->packet && (!chardev_lanes_empty(ddev) ||
+				ring_space(&ddev->tx) != BUF_SIZE))
+		err = -EBUSY;
+	else
+		WRITE_ONCE(ddev->tx_crc, true);
+	mutex_unlock(&ddev->mutex);
+	up_write(&ddev->mode_sem);
+
+	return err;
+}
+
+/*
+ * Turning fan-out on starts every reader at the oldest buffered byte, turning
+ * it off makes them share the cursor of the slowest one.
+ */
+static long chardev_set_fanout(struct ddone_device *ddev, unsigned long mode)
+{
+	struct ddone_file *dfile;
+
+	if (mode != DDONE_FANOUT_OFF && mode != DDONE_FANOUT_BLOCK &&
+			mode != DDONE_FANOUT_DROP)
+		return -EINVAL;
+
+	mutex_lock(&ddev->read_mutex);
+	if (!ddev->fanout) {
+		spin_lock(&ddev->rx.lock);
+		list_for_each_entry(dfile, &ddev->readers, node)
+			dfile->rpos = ddev->rx.rpos;
+		spin_unlock(&ddev->rx.lock);
+	}
+	WRITE_ONCE(ddev->fanout, mode);
+	mutex_unlock(&ddev->read_mutex);
+
+	wake_up_interruptible(&ddev->rx.rq);
+	return 0;
+}
+
+//Swaps the history buffer, offsets keep counting from probe
+static long chardev_set_history(struct ddone_device *ddev, unsigned long size)
+{
+	char *hist = NULL;
+
+	if (size > MAX_HISTORY_SIZE)
+		return -EINVAL;
+	if (size) {
+		size = roundup_pow_of_two(max_t(unsigned long, size, BUF_SIZE));
+		hist = vmalloc(size);
+		if (!hist)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&ddev->mutex);
+	down_write(&ddev->hist_sem);
+	swap(hist, ddev->hist);
+	ddev->hist_size = size;
+	ddev->hist_start = ddev->hist_tail;
+	up_write(&ddev->hist_sem);
+	mutex_unlock(&ddev->mutex);
+
+	vfree(hist);
+	wake_up_interruptible(&ddev->rx.rq);
+	return 0;
+}
+
+static long chardev_set_coalesce(struct ddone_device *ddev,
+		struct ddone_coalesce __user *ucoal)
+{
+	struct ddone_coalesce coal;
+
+	if (copy_from_user(&coal, ucoal, sizeof(coal)))
+		return -EFAULT;
+	if (coal.timeout_ms > MAX_COALESCE_TIMEOUT ||
+			(coal.bytes && !coal.timeout_ms))
+		return -EINVAL;
+
+	mutex_lock(&ddev->mutex);
+	ddev->tx_low = min_t(size_t, coal.bytes, MEM_SIZE);
+	ddev->tx_delay = msecs_to_jiffies(coal.timeout_ms);
+	ddev->tx_held = false;
+	mutex_unlock(&ddev->mutex);
+
+	mod_delayed_work(ddev->device_wq, &ddev->dwork, 0);
+	return 0;
+}
+
+static long chardev_set_compress(struct ddone_device *ddev,
+		unsigned long mode)
+{
+	void *wrkmem = NULL;
+
+	if (mode != DDONE_COMPRESS_NONE && mode != DDONE_COMPRESS_LZ4)
+		return -EINVAL;
+	if (mode == DDONE_COMPRESS_LZ4) {
+		wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+		if (!wrkmem)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&ddev->mutex);
+	swap(wrkmem, ddev->lz_wrkmem);
+	mutex_unlock(&ddev->mutex);
+
+	vfree(wrkmem);
+	return 0;
+}
+
+static long chardev_get_crc_stats(struct ddone_device *ddev,
+		struct ddone_crc_stats __user *ustats)
+{
+	struct ddone_crc_stats stats;
+
+	mutex_lock(&ddev->mutex);
+	stats.tx_chunks = ddev->crc_tx;
+	stats.rx_chunks = ddev->crc_rx;
+	stats.rx_errors = ddev->crc_errors;
+	mutex_unlock(&ddev->mutex);
+
+	return copy_to_user(ustats, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static long chardev_set_forward(struct ddone_device *ddev, unsigned long arg)
+{
+	struct ddone_device *to = NULL;
+	long err = 0;
+
+	if (arg != DDONE_FORWARD_OFF && arg >= DEVICE_COUNT)
+		return -EINVAL;
+
+	//Keeps the target from going away until the worker can see fwd
+	mutex_lock(&ddone_devs_lock);
+	if (arg != DDONE_FORWARD_OFF) {
+		to = ddone_devs[arg];
+		if (!to) {
+			err = -ENODEV;
+			goto out;
+		}
+		if (to == ddev) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	mutex_lock(&ddev->mutex);
+	ddev->fwd = to;
+	mutex_unlock(&ddev->mutex);
+out:
+	mutex_unlock(&ddone_devs_lock);
+	return err;
+}
+
+//The lane stays until the file is closed, later calls only move it
+static long chardev_set_prio(struct ddone_file *dfile, unsigned long prio)
+{
+	struct ddone_device *ddev = dfile->ddev;
+	struct ddone_ring *lane = NULL;
+
+	if (prio >= DDONE_PRIO_COUNT)
+		return -EINVAL;
+
+	if (!dfile->lane) {
+		lane = kzalloc(sizeof(*lane), GFP_KERNEL);
+		if (!lane)
+			return -ENOMEM;
+		ring_init(lane);
+	}
+
+	mutex_lock(&ddev->mutex);
+	if (!dfile->lane) {
+		smp_store_release(&dfile->lane, lane);
+		lane = NULL;
+	}
+	list_move_tail(&dfile->lane_node, &ddev->lanes[prio]);
+	mutex_unlock(&ddev->mutex);
+
+	kfree(lane);//Lost a race with another caller
+	return 0;
+}
+
+static long chardev_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct ddone_file *dfile = filp->private_data;
+	struct ddone_device *ddev = dfile->ddev;
+	u64 dropped, end;
+
+	if (_IOC_TYPE(cmd) != DDONE_IOC_MAGIC)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case DDONE_SET_POLL:
+		if (arg > MAX_POLL_INTERVAL || arg < MIN_POLL_INTERVAL)
+			return -EINVAL;
+		ddev->poll_time = msecs_to_jiffies(arg);
+		pr_info("Poll interval set to %lu\n", arg);
+		break;
+	case DDONE_SET_MODE:
+		return chardev_set_mode(ddev, arg);
+	case DDONE_SET_TSTAMP:
+		mutex_lock(&ddev->read_mutex);
+		ddev->rx_tstamp = !!arg;
+		mutex_unlock(&ddev->read_mutex);
+		break;
+	case DDONE_SET_FANOUT:
+		return chardev_set_fanout(ddev, arg);
+	case DDONE_GET_DROPPED:
+		mutex_lock(&ddev->read_mutex);
+		dropped = dfile->dropped;
+		mutex_unlock(&ddev->read_mutex);
+		return put_user(dropped, (u64 __user *)arg);
+	case DDONE_SET_COALESCE:
+		return chardev_set_coalesce(ddev, (void __user *)arg);
+	case DDONE_FLUSH:
+		spin_lock(&ddev->tx.lock);
+		end = ddev->tx.head;
+		spin_unlock(&ddev->tx.lock);
+		chardev_tx_flush(ddev, end);
+		break;
+	case DDONE_SET_COMPRESS:
+		return chardev_set_compress(ddev, arg);
+	case DDONE_SET_CRC:
+		return chardev_set_crc(ddev, arg);
+	case DDONE_GET_CRC_STATS:
+		return chardev_get_crc_stats(ddev, (void __user *)arg);
+	case DDONE_SET_PRIO:
+		return chardev_set_prio(dfile, arg);
+	case DDONE_SET_FORWARD:
+		return chardev_set_forward(ddev, arg);
+	case DDONE_SET_HISTORY:
+		return chardev_set_history(ddev, arg);
+	case DDONE_RECV_BATCH:
+		return chardev_recv_batch(filp, (void __user *)arg);
+	case DDONE_SEND_BATCH:
+		return chardev_send_batch(filp, (void __user *)arg);
+	default: return -ENOTTY;
+	}
+
+
+	return 0;
+}
+
+static int chardev_open(struct inode *inode, struct file *filep)
+{
+	struct ddone_device *ddev;
+	struct ddone_file *dfile;
+
+	ddev = container_of(inode->i_cdev, struct ddone_device, cdev);
+	dfile = kzalloc(sizeof(*dfile), GFP_KERNEL);
+	if (!dfile)
+		return -ENOMEM;
+	dfile->ddev = ddev;
+	dfile->crc_errors = READ_ONCE(ddev->crc_errors);
+	INIT_LIST_HEAD(&dfile->node);
+	INIT_LIST_HEAD(&dfile->lane_node);
+	filep->private_data = dfile;
+
+	//Writers only must not hold back reclamation in fan-out mode
+	if (filep->f_mode & FMODE_READ) {
+		mutex_lock(&ddev->read_mutex);
+		spin_lock(&ddev->rx.lock);
+		dfile->rpos = ddev->rx.rpos;
+		spin_unlock(&ddev->rx.lock);
+		list_add_tail(&dfile->node, &ddev->readers);
+		mutex_unlock(&ddev->read_mutex);
+	}
+	//read_iter/write_iter honour IOCB_NOWAIT, let io_uring issue inline
+	filep->f_mode |= FMODE_NOWAIT;
+
+	pr_info("Chardev open\n");
+
 
-static int  ring_write(struct ddone_device *ddev, char **buf, size_t *count);
-static void ring_read(struct ddone_device *ddev, char **buf, size_t *count);
 
-static u32  ddone_device_read_mem8(struct ddone_device *dev, u32 offset);
-static u32  ddone_device_read_reg32(struct ddone_device *dev, u32 offset);
-static void ddone_device_write_mem8(struct ddone_device *dev, u32 offset,
-		u8 val);
-static void ddone_device_write_reg32(struct ddone_device *dev, u32 offset,
-		u32 val);
+	return 0;
+}
 
+static int chardev_release(struct inode *inode, struct file *filep)
+{
+	struct ddone_file *dfile = filep->private_data;
+	struct ddone_device *ddev = dfile->ddev;
 
-static struct platform_driver ddone_driver = {
-	.driver = {
-		.name = DEVICE_NAME,
-	},
-	.probe = device_probe,
-	.remove = device_remove
-};
+	mutex_lock(&ddev->read_mutex);
+	list_del(&dfile->node);
+	if (ddev->fanout)
+		chardev_rx_reclaim(ddev);
+	mutex_unlock(&ddev->read_mutex);
 
-static const struct file_operations fops = {
-	.owner	= THIS_MODULE,
-	.read	= chardev_read,
-	.write	= chardev_write,
-	.open	= chardev_open,
-	.unlocked_ioctl  = chardev_ioctl
-};
+	//Whatever is still queued in the lane goes with it
+	mutex_lock(&ddev->mutex);
+	list_del(&dfile->lane_node);
+	mutex_unlock(&ddev->mutex);
 
-static u32 ddone_device_read_mem8(struct ddone_device *dev, u32 offset)
-{
-	return ioread8(dev->mem + offset);
+	kfree(dfile->lane);
+	kfree(dfile);
+	return 0;
 }
-static u32 ddone_device_read_reg32(struct ddone_device *dev, u32 offset)
+
+/*
+ * Switches the file to reading history for good, SEEK_END is the newest RX
+ * byte. Its RX cursor stops there, so it leaves the readers that hold back
+ * fan-out reclamation.
+ */
+static loff_t chardev_llseek(struct file *filp, loff_t offset, int whence)
 {
-	return ioread32(dev->regs + offset);
+	struct ddone_file *dfile = filp->private_data;
+	struct ddone_device *ddev = dfile->ddev;
+	bool hist;
+
+	down_read(&ddev->hist_sem);
+	hist = ddev->hist;
+	up_read(&ddev->hist_sem);
+	if (!hist)
+		return -ESPIPE;
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += filp->f_pos;
+		break;
+	case SEEK_END:
+		offset += smp_load_acquire(&ddev->hist_tail);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (offset < 0)
+		return -EINVAL;
+
+	filp->f_pos = offset;
+	if (!READ_ONCE(dfile->history)) {
+		mutex_lock(&ddev->read_mutex);
+		list_del_init(&dfile->node);
+		if (ddev->fanout)
+			chardev_rx_reclaim(ddev);
+		WRITE_ONCE(dfile->history, true);
+		mutex_unlock(&ddev->read_mutex);
+	}
+	return offset;
 }
-static void ddone_device_write_mem8(struct ddone_device *dev, u32 offset,
-		u8 val)
+
+//Wakes the members to push striped TX or take the next RX chunk
+static void agg_kick(struct ddone_agg *agg)
 {
-	iowrite8(val, dev->mem+offset);
+	int i;
+
+	for (i = 0; i < DEVICE_COUNT; i++) {
+		if (agg->members[i])
+			mod_delayed_work(agg->members[i]->device_wq,
+					&agg->members[i]->dwork, 0);
+	}
 }
-static void ddone_device_write_reg32(struct ddone_device *dev, u32 offset,
-		u32 val)
+
+static int agg_open(struct inode *inode, struct file *filep)
 {
-	iowrite32(val, dev->regs+offset);
+	filep->private_data = container_of(inode->i_cdev, struct ddone_agg,
+			cdev);
+
+	pr_info("Aggregate open\n");
+
+	return 0;
 }
 
-static int ring_write(struct ddone_device *ddev, char **buf, size_t *count)
+static ssize_t agg_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	int oldw;
-	size_t end;
-	int err;
-
-	while ((ddev->w + 1) % BUF_SIZE == ddev->r) {//If buffer full
-		mutex_unlock(&ddev->mutex);
-		err = wait_event_interruptible(ddev->wq,
-				(ddev->w + 1) % BUF_SIZE != ddev->r);
-		if (err) {
-			*count = 0;
-			mutex_lock(&ddev->mutex);
-			return -EFBIG;
+	struct ddone_agg *agg = iocb->ki_filp->private_data;
+	size_t count, copied, done;
+	u64 pos;
+	int err = 0;
+
+	if (!READ_ONCE(agg->nr_members))
+		return -ENOTCONN;
+
+	done = 0;
+	while (iov_iter_count(from)) {
+		count = min_t(size_t, iov_iter_count(from), BUF_SIZE);
+		count -= fault_in_iov_iter_readable(from, count);
+		if (!count) {
+			err = -EFAULT;
+			break;
 		}
-		mutex_lock(&ddev->mutex);
-	}
-
-	oldw = ddev->w;
-	//Here we can write safely to r - 1
-	ddev->w = (ddev->w + 1) % BUF_SIZE;
-	if (ddev->r > ddev->w)
-		end = ddev->r;
-	else
-		end = BUF_SIZE;
 
-	if (*count >= (end - ddev->w))
-		*count = end - ddev->w;
+		err = ring_reserve(&agg->tx, 1, &count, &pos,
+				chardev_nonblock(iocb));
+		if (err)
+			break;
 
-	*buf = ddev->data + ddev->w;
+		copied = ring_copy_from_iter(&agg->tx, pos, count, from);
+		if (copied != count)
+			ring_fill(&agg->tx, pos + copied, 0, count - copied);
+		ring_commit(&agg->tx, pos, count);
 
+		mutex_lock(&agg->mutex);
+		agg_kick(agg);
+		mutex_unlock(&agg->mutex);
 
-	ddev->w = (ddev->w + *count - 1) % BUF_SIZE;
+		done += copied;
+		if (copied != count) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	iocb->ki_pos += done;
 
-	pr_info("W %d => %d      %lu\n", oldw, ddev->w, *count);
-	return 0;
+	return done ? done : err;
 }
 
-static ssize_t chardev_write(struct file *filp, const char __user *buf,
-		size_t count, loff_t *f_pos)
+static ssize_t agg_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct ddone_device *ddev;
-	char *start;
+	struct ddone_agg *agg = iocb->ki_filp->private_data;
+	size_t count, copied;
 	int err;
 
-	ddev = filp->private_data;
+	if (!iov_iter_count(to))
+		return 0;
+
+	for (;;) {
+		if (!ring_avail(&agg->rx)) {
+			if (chardev_nonblock(iocb))
+				return -EAGAIN;
+			err = wait_event_interruptible(agg->rx.rq,
+					ring_avail(&agg->rx));
+			if (err)
+				return 0;//Return 0 count to indicate end of stream
+		}
 
-	mutex_lock(&ddev->mutex);
+		err = chardev_lock(&agg->read_mutex, iocb);
+		if (err)
+			return err;
+		if (ring_avail(&agg->rx))
+			break;
+		//Another reader was faster
+		mutex_unlock(&agg->read_mutex);
+	}
 
-	err = ring_write(ddev, &start, &count);
-	if (err)
-		goto err_write;
+	count = min(ring_avail(&agg->rx), iov_iter_count(to));
+	copied = ring_copy_to_iter(&agg->rx, agg->rx.rpos, count, to);
+	ring_consume(&agg->rx, copied);
+	iocb->ki_pos += copied;
+	mutex_unlock(&agg->read_mutex);
 
-	if (copy_from_user(start, buf, count))
-		goto err_write;
-	*f_pos += count;
+	//The next chunk may be waiting for this room
+	mutex_lock(&agg->mutex);
+	agg_kick(agg);
+	mutex_unlock(&agg->mutex);
 
-	ddev->bytes_to_write += count;
-	mutex_unlock(&ddev->mutex);
-	wake_up_interruptible(&ddev->rq);//Notify readers
+	return copied ? copied : -EFAULT;
+}
+
+static long agg_set_stripe(struct ddone_agg *agg, unsigned long mask)
+{
+	struct ddone_device *ddev;
+	long err = 0;
+	int i;
 
-	return count;
+	if (mask >> DEVICE_COUNT)
+		return -EINVAL;
 
-err_write:
-	mutex_unlock(&ddev->mutex);
+	mutex_lock(&ddone_devs_lock);
+	for (i = 0; i < DEVICE_COUNT; i++) {
+		if ((mask & BIT(i)) && !ddone_devs[i]) {
+			err = -ENODEV;
+			goto out;
+		}
+	}
 
+	mutex_lock(&agg->mutex);
+	agg->nr_members = 0;
+	agg->tx_seq = 0;
+	agg->rx_seq = 0;
+	mutex_unlock(&agg->mutex);
+
+	for (i = 0; i < DEVICE_COUNT; i++) {
+		ddev = ddone_devs[i];
+		if (!ddev)
+			continue;
+		mutex_lock(&ddev->mutex);
+		mutex_lock(&agg->mutex);
+		ddev->agg = (mask & BIT(i)) ? agg : NULL;
+		agg->members[i] = ddev->agg ? ddev : NULL;
+		agg->nr_members += !!ddev->agg;
+		mutex_unlock(&agg->mutex);
+		mutex_unlock(&ddev->mutex);
+	}
+out:
+	mutex_unlock(&ddone_devs_lock);
 	return err;
+}
+
+static long agg_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	if (_IOC_TYPE(cmd) != DDONE_IOC_MAGIC)
+		return -ENOTTY;
 
+	switch (cmd) {
+	case DDONE_SET_STRIPE:
+		return agg_set_stripe(filp->private_data, arg);
+	default: return -ENOTTY;
+	}
 }
 
-static void ring_read(struct ddone_device *ddev, char **buf, size_t *count)
+static void device_push(struct ddone_device *ddev, u32 flags, size_t size)
 {
-	size_t end;
-	int oldr, err;
+	//Size has to be in place before the peer sees DATA_READY
+	ddone_device_write_reg32(ddev, SIZE_REG, size);
+	ddone_device_write_reg32(ddev, FLAGS_REG, flags | DATA_READY | DATA_TX);
 
-	while (ddev->r == ddev->w) {//Wait for new data
-		mutex_unlock(&ddev->mutex);
-		err = wait_event_interruptible(ddev->rq, ddev->r != ddev->w);
-		if (err) {
-			*count = 0;
-			//To prevent mutex unlock errors later
-			mutex_lock(&ddev->mutex);
-			return;
-		}
+	chardev_uring_complete(ddev, 0);
+}
 
-		mutex_lock(&ddev->mutex);
+/*
+ * Nothing is queued and the window is free, fill it straight from the iter.
+ * The bytes (plus extra for a record header) still take a slot in the TX
+ * stream offsets, which is consumed right away, so pushed offsets stay
+ * comparable with the ring. The user copy runs with page faults disabled,
+ * the mutex stalls the worker, anything short goes the ring path instead.
+ */
+static int device_cut_through(struct ddone_device *ddev,
+		struct iov_iter *from, size_t extra, bool nowait, size_t *done,
+		u64 *end)
+{
+	u32 flags;
+	size_t size, copied;
+	u64 pos;
+
+	size = min_t(size_t, iov_iter_count(from), MEM_SIZE);
+	//Small writes wait in the ring for company
+	if (!size || (!extra && size < READ_ONCE(ddev->tx_low)))
+		return 0;
+	//Under IOCB_NOWAIT only pages already in can make it
+	if (!nowait)
+		fault_in_iov_iter_readable(from, size);
+
+	//Never wait for the worker here, the ring path is just as good
+	if (!mutex_trylock(&ddev->mutex))
+		return 0;
+
+	/*
+	 * Queued lane data goes out before shared ring writes, and a striping
+	 * member's chunks need the aggregate's sequence numbers.
+	 */
+	flags = ddone_device_read_reg32(ddev, FLAGS_REG);
+	if ((flags & DATA_READY) || ddev->mem_offset || ddev->lz_wrkmem ||
+			ddev->tx_crc || ddev->agg || ring_avail(&ddev->tx) ||
+			!chardev_lanes_empty(ddev))
+		goto out;
+	flags &= ~(DATA_LZ4 | DATA_CRC | DATA_SEQ | DATA_TX);
+
+	//Window is mapped write-combined, so a plain user copy into it is fine
+	pagefault_disable();
+	copied = copy_from_iter((void __force *)ddev->mem, size, from);
+	pagefault_enable();
+	if (copied != size) {
+		iov_iter_revert(from, copied);
+		goto out;
+	}
 
+	//A writer that queued meanwhile goes first, ours is left unpushed
+	spin_lock(&ddev->tx.lock);
+	if (ddev->tx.head != ddev->tx.rpos) {
+		spin_unlock(&ddev->tx.lock);
+		iov_iter_revert(from, size);
+		goto out;
 	}
+	pos = ddev->tx.head;
+	ddev->tx.head += extra + size;
+	spin_unlock(&ddev->tx.lock);
 
-	oldr = ddev->r;
-	//We can safely read here
-	ddev->r = (ddev->r + 1) % BUF_SIZE;
-	if (ddev->w >= ddev->r)
-		end = ddev->w;
-	else
-		end = BUF_SIZE - 1;
+	ring_commit(&ddev->tx, pos, extra + size);
+	ring_consume(&ddev->tx, extra + size);
 
-	if (*count > end - ddev->r)
-		*count = end - ddev->r;
+	*done += size;
+	*end = pos + extra + size;
+	device_push(ddev, flags, size);
+out:
+	mutex_unlock(&ddev->mutex);
+	return 0;
+}
 
-	*buf = ddev->data + ddev->r;
+static void device_seal(struct ddone_device *ddev, size_t size, u32 crc)
+{
+	__le32 le = cpu_to_le32(~crc);
 
-	ddev->r = (ddev->r + *count) % BUF_SIZE;
+	memcpy_toio(ddev->mem + size, &le, CRC_SIZE);
+	ddev->crc_tx++;
+}
 
-	*count = *count + 1;
-	pr_info("R %d => %d   %lu\n", oldr, ddev->r, *count);
+/*
+ * Header of the record at the ring consumer. Set mode keeps writers from
+ * mixing framings, this only guards the window against a broken ring by
+ * dropping whatever is queued in it.
+ */
+static bool device_tx_record(struct ddone_ring *ring,
+		struct ddone_rec_hdr *hdr, size_t max)
+{
+	ring_copy_out(ring, ring->rpos, hdr, sizeof(*hdr));
+	if (hdr->len <= max &&
+			sizeof(*hdr) + hdr->len <= ring_avail(ring))
+		return true;
+
+	pr_err("Bad %u byte TX record, dropping the queue\n", hdr->len);
+	ring_consume(ring, ring_avail(ring));
+	return false;
 }
 
-static ssize_t chardev_read(struct file *filp, char __user *buf, size_t count,
-		loff_t *f_pos)
+/*
+ * Compresses the next record, or as much of the stream as fits the window,
+ * into the window. Returns false if it does not get smaller, the chunk is
+ * sent raw then.
+ */
+static bool device_write_lz4(struct ddone_device *ddev,
+		struct ddone_ring *ring, u32 flags, size_t trailer)
 {
-	struct ddone_device *ddev;
-	char *start;
-	int err;
+	struct ddone_rec_hdr hdr;
+	int src_len, len;
+	size_t used;
+
+	if (ddev->packet) {
+		if (!device_tx_record(ring, &hdr, MEM_SIZE - trailer))
+			return true;
+		src_len = hdr.len;
+		ring_copy_out(ring, ring->rpos + sizeof(hdr),
+				ddev->lz_src, src_len);
+		len = LZ4_compress_default(ddev->lz_src, ddev->lz_dst, src_len,
+				MEM_SIZE - trailer, ddev->lz_wrkmem);
+		used = sizeof(hdr) + src_len;
+	} else {
+		//The peer inflates into at most BUF_SIZE, as much as the ring
+		src_len = ring_avail(ring);
+		ring_copy_out(ring, ring->rpos, ddev->lz_src, src_len);
+		len = LZ4_compress_destSize(ddev->lz_src, ddev->lz_dst,
+				&src_len, MEM_SIZE - trailer, ddev->lz_wrkmem);
+		used = src_len;
+	}
+	if (len <= 0 || len >= src_len)
+		return false;
 
-	ddev = filp->private_data;
+	memcpy_toio(ddev->mem, ddev->lz_dst, len);
+	if (trailer) {
+		device_seal(ddev, len, crc32c(~0, ddev->lz_dst, len));
+		flags |= DATA_CRC;
+	}
+	ring_consume(ring, used);
+	device_push(ddev, flags | DATA_LZ4, len + trailer);
 
-	mutex_lock(&ddev->mutex);
+	return true;
+}
 
-	while (ddev->bytes_to_write != 0) {
-		pr_err("Device is busy\n");
-		mutex_unlock(&ddev->mutex);
-		err = wait_event_interruptible(ddev->rq,
-				ddev->bytes_to_write == 0);
-		mutex_lock(&ddev->mutex);
-		if (err) {
-			err = 0;//Return 0 count to indicate end of stream
-			goto stop;
-		}
+static void device_try_write_to(struct ddone_device *ddev,
+		struct ddone_ring *ring)
+{
+	struct ddone_rec_hdr hdr;
+	u32 flags;
+	size_t size, trailer;
+	u64 pos;
+
+	flags = ddone_device_read_reg32(ddev, FLAGS_REG);
+
+
+	if (flags & DATA_READY)
+		return;
+
+	flags &= ~(DATA_LZ4 | DATA_CRC | DATA_SEQ | DATA_TX);
+	trailer = ddev->tx_crc ? CRC_SIZE : 0;
+	if (ddev->lz_wrkmem && device_write_lz4(ddev, ring, flags, trailer)) {
+		ddev->tx_held = false;
+		return;
 	}
-	ring_read(ddev, &start, &count);
 
-	if (count != 0) {
-		if (copy_to_user(buf, start, count)) {
-			err = -ENOMEM;
-			goto stop;
+	if (ddev->packet) {
+		//Sealing only comes on with no records queued, so all fit
+		if (!device_tx_record(ring, &hdr, MEM_SIZE - trailer)) {
+			ddev->tx_held = false;
+			return;
 		}
+		pos = ring->rpos + sizeof(hdr);
+		size = hdr.len;
+	} else {
+		pos = ring->rpos;
+		size = min_t(size_t, ring_avail(ring), MEM_SIZE - trailer);
+	}
+	ring_copy_to_io(ring, pos, ddev->mem, size);
+	if (trailer) {
+		device_seal(ddev, size, ring_crc32c(ring, pos, size, ~0));
+		flags |= DATA_CRC;
 	}
-	*f_pos += count;
+	ring_consume(ring, pos + size - ring->rpos);
 
+	//We transfered all data
+	device_push(ddev, flags, size + trailer);
+	ddev->tx_held = false;
+
+}
 
+//Pushes the next chunk of the aggregate stream if the window is free
+static bool device_stripe_tx(struct ddone_device *ddev)
+{
+	struct ddone_agg *agg = ddev->agg;
+	__le32 seq;
+	size_t size;
+	u32 flags;
 
+	flags = ddone_device_read_reg32(ddev, FLAGS_REG);
+	if (flags & DATA_READY)
+		return false;
 
-	mutex_unlock(&ddev->mutex);
-	wake_up_interruptible(&ddev->wq);//Notify writers
-	return count;
-stop:
-	mutex_unlock(&ddev->mutex);
-	return err;
+	mutex_lock(&agg->mutex);
+	size = min_t(size_t, ring_avail(&agg->tx), MEM_SIZE - SEQ_SIZE);
+	if (!size) {
+		mutex_unlock(&agg->mutex);
+		return false;
+	}
+	seq = cpu_to_le32(agg->tx_seq++);
+	memcpy_toio(ddev->mem, &seq, SEQ_SIZE);
+	ring_copy_to_io(&agg->tx, agg->tx.rpos, ddev->mem + SEQ_SIZE, size);
+	ring_consume(&agg->tx, size);
+	mutex_unlock(&agg->mutex);
 
+	flags &= ~(DATA_LZ4 | DATA_CRC);
+	device_push(ddev, flags | DATA_SEQ, SEQ_SIZE + size);
+
+	return true;
 }
 
-static long chardev_ioctl(struct file *filp, unsigned int cmd,
-		unsigned long arg)
+/*
+ * Stream mode coalescing: a short TX ring is pushed once it reaches tx_low,
+ * is flushed or was held for tx_delay. *delay is how long it may still wait.
+ */
+static bool device_tx_ready(struct ddone_device *ddev, unsigned long *delay)
 {
-	struct ddone_device *ddev = filp->private_data;
+	size_t avail;
+	bool flush;
+
+	avail = ring_avail(&ddev->tx);
+	if (!avail)
+		return false;
+	if (ddev->packet || avail >= ddev->tx_low)
+		return true;
+
+	spin_lock(&ddev->tx.lock);
+	flush = ddev->tx_flush > ddev->tx.rpos;
+	spin_unlock(&ddev->tx.lock);
+	if (flush)
+		return true;
+
+	if (!ddev->tx_held) {
+		ddev->tx_deadline = jiffies + ddev->tx_delay;
+		ddev->tx_held = true;
+	}
+	if (time_after_eq(jiffies, ddev->tx_deadline))
+		return true;
 
-	if (_IOC_TYPE(cmd) != DDONE_IOC_MAGIC)
-		return -ENOTTY;
+	*delay = min_t(unsigned long, *delay, ddev->tx_deadline - jiffies);
+	return false;
+}
 
-	switch (cmd) {
-	case DDONE_SET_POLL:
-		if (arg > MAX_POLL_INTERVAL || arg < MIN_POLL_INTERVAL)
-			return -EINVAL;
-		ddev->poll_time = msecs_to_jiffies(arg);
-		pr_info("Poll interval set to %lu\n", arg);
-		break;
-	default: return -ENOTTY;
+//Keeps a copy of size RX payload bytes at ring pos, ddev->mutex held
+static void device_hist_append(struct ddone_device *ddev, u64 pos,
+		size_t size)
+{
+	size_t off, first;
+	u64 head;
+
+	head = ddev->hist_tail + size;
+	if (!ddev->hist) {
+		ddev->hist_head = head;
+		smp_store_release(&ddev->hist_tail, head);
+		return;
 	}
 
+	off = ddev->hist_tail & (ddev->hist_size - 1);
+	first = min(size, ddev->hist_size - off);
+	WRITE_ONCE(ddev->hist_head, head);
+	smp_wmb();//Readers check head after copying
+	ring_copy_out(&ddev->rx, pos, ddev->hist + off, first);
+	ring_copy_out(&ddev->rx, pos + first, ddev->hist, size - first);
+	smp_store_release(&ddev->hist_tail, head);
+}
 
-	return 0;
+/*
+ * DDONE_FANOUT_DROP: moves the oldest readers forward, whole records in
+ * packet mode, until need bytes fit. Never waits for a reader, a busy
+ * read_mutex leaves it to the next poll.
+ */
+static void device_rx_drop(struct ddone_device *ddev, size_t need)
+{
+	struct ddone_file *dfile;
+	struct ddone_rx_hdr hdr;
+	u64 pos, tail;
+
+	if (!mutex_trylock(&ddev->read_mutex))
+		return;
+	if (ddev->fanout != DDONE_FANOUT_DROP)
+		goto out;
+
+	spin_lock(&ddev->rx.lock);
+	tail = ddev->rx.tail;
+	spin_unlock(&ddev->rx.lock);
+
+	pos = ddev->rx.rpos;
+	if (!ddev->rx_packet) {
+		pos = max(pos, ddev->rx.head + need - BUF_SIZE);
+		pos = min(pos, tail);
+	}
+	while (ddev->rx_packet && pos < tail &&
+			BUF_SIZE - (ddev->rx.head - pos) < need) {
+		ring_copy_out(&ddev->rx, pos, &hdr, sizeof(hdr));
+		pos += sizeof(hdr) + hdr.rec.len;
+	}
+	if (pos == ddev->rx.rpos)
+		goto out;
+
+	spin_lock(&ddev->rx.lock);
+	list_for_each_entry(dfile, &ddev->readers, node) {
+		if (dfile->rpos >= pos)
+			continue;
+		dfile->dropped += pos - dfile->rpos;
+		dfile->rpos = pos;
+	}
+	spin_unlock(&ddev->rx.lock);
+	ring_consume(&ddev->rx, pos - ddev->rx.rpos);
+out:
+	mutex_unlock(&ddev->read_mutex);
 }
 
-static int chardev_open(struct inode *inode, struct file *filep)
+//Room for a window chunk in the RX ring, made by dropping if allowed to
+static int device_rx_reserve(struct ddone_device *ddev, size_t min,
+		size_t *count, u64 *pos)
 {
-	struct ddone_device *ddev;
+	int err;
 
-	ddev = container_of(inode->i_cdev, struct ddone_device, cdev);
-	filep->private_data = ddev;
+	err = ring_reserve(&ddev->rx, min, count, pos, true);
+	if (err != -EAGAIN || READ_ONCE(ddev->fanout) != DDONE_FANOUT_DROP)
+		return err;
 
+	device_rx_drop(ddev, *count);
+	return ring_reserve(&ddev->rx, min, count, pos, true);
+}
 
-	pr_info("Chardev open\n");
+//Hands the window back to the peer once the chunk is in the RX ring
+static void device_rx_release(struct ddone_device *ddev, u32 flags)
+{
+	ddone_device_write_reg32(ddev, FLAGS_REG,
+			flags & ~(DATA_READY | DATA_LZ4 | DATA_CRC | DATA_SEQ |
+				DATA_TX));
+	ddev->mem_offset = 0;
+	ddev->rx_ts = 0;
+	ddev->rx_raw_len = 0;
+}
+
+//Copies chunk bytes at off to a ring, from rx_raw if it was inflated
+static void device_rx_copy(struct ddone_device *ddev, struct ddone_ring *ring,
+		u64 pos, size_t off, size_t size)
+{
+	if (ddev->rx_raw_len)
+		ring_copy_in(ring, pos, ddev->rx_raw + off, size);
+	else
+		ring_copy_from_io(ring, pos, ddev->mem + off, size);
+}
 
+//Checks crc over size chunk bytes against the trailer that follows them
+static bool device_crc_ok(struct ddone_device *ddev, const void *trailer,
+		u32 crc)
+{
+	__le32 le;
 
+	memcpy(&le, trailer, CRC_SIZE);
+	ddev->crc_rx++;
+	if (le32_to_cpu(le) == ~crc)
+		return true;
 
-	return 0;
+	WRITE_ONCE(ddev->crc_errors, ddev->crc_errors + 1);
+	return false;
 }
 
-static void device_try_write_to(struct ddone_device *ddev)
+static bool device_crc_ok_io(struct ddone_device *ddev, size_t size, u32 crc)
 {
-	u32 flags;
-	u8 data;
-	size_t size;
-	char *start;
-	int i;
+	u8 trailer[CRC_SIZE];
 
-	size = MEM_SIZE;
+	memcpy_fromio(trailer, ddev->mem + size, CRC_SIZE);
+	return device_crc_ok(ddev, trailer, crc);
+}
 
+/*
+ * Inflates an LZ4 chunk into rx_raw once, returns its length or 0 if
+ * corrupt. A sealed block is checked before it is inflated.
+ */
+static size_t device_rx_inflate(struct ddone_device *ddev, size_t size,
+		u32 flags)
+{
+	int len;
 
-	flags = ddone_device_read_reg32(ddev, FLAGS_REG);
+	if (ddev->rx_raw_len)
+		return ddev->rx_raw_len;
 
+	memcpy_fromio(ddev->rx_lz, ddev->mem,
+			size + ((flags & DATA_CRC) ? CRC_SIZE : 0));
+	if ((flags & DATA_CRC) && !device_crc_ok(ddev, ddev->rx_lz + size,
+				crc32c(~0, ddev->rx_lz, size))) {
+		pr_info_ratelimited("Dropping LZ4 chunk with bad CRC32C\n");
+		return 0;
+	}
+	len = LZ4_decompress_safe(ddev->rx_lz, ddev->rx_raw, size, BUF_SIZE);
+	if (len <= 0) {
+		pr_info_ratelimited("Dropping corrupt LZ4 chunk of %zu bytes\n",
+				size);
+		return 0;
+	}
 
-	if (flags & DATA_READY)
+	ddev->rx_raw_len = len;
+	return len;
+}
+
+//Packet mode: the whole window becomes one record or waits for room
+static void device_read_record(struct ddone_device *ddev, u32 flags,
+		size_t size)
+{
+	struct ddone_rx_hdr hdr;
+	size_t total;
+	u64 pos;
+
+	total = sizeof(hdr) + size;
+	if (device_rx_reserve(ddev, total, &total, &pos))
 		return;
 
-	ring_read(ddev, &start, &size);
+	hdr.rec.len = size;
+	hdr.rec.flags = 0;
+	hdr.ts = ddev->rx_ts;
+	hdr.ts_raw = ddev->rx_ts_raw;
+	device_rx_copy(ddev, &ddev->rx, pos + sizeof(hdr), 0, size);
+	//Inflated chunks were checked before, in their compressed form
+	if ((flags & DATA_CRC) && !(flags & DATA_LZ4) &&
+			!device_crc_ok_io(ddev, size, ring_crc32c(&ddev->rx,
+					pos + sizeof(hdr), size, ~0)))
+		hdr.rec.flags |= DDONE_MSG_BADCRC;
+	ring_copy_in(&ddev->rx, pos, &hdr, sizeof(hdr));
+	device_hist_append(ddev, pos + sizeof(hdr), size);
+	ring_commit(&ddev->rx, pos, total);
+
+	device_rx_release(ddev, flags);
+}
+
+/*
+ * Moves the RX chunk from the window straight into the TX ring of the
+ * device it is forwarded to, framed the way that device is set up. Like a
+ * writer it waits for room there by leaving the window to the next poll.
+ */
+static void device_forward(struct ddone_device *ddev, u32 flags, size_t size)
+{
+	struct ddone_device *to = ddev->fwd;
+	struct ddone_rec_hdr hdr;
+	size_t count, hlen, total;
+	bool verify;
+	u64 pos;
+
+	//Mode change in progress on the other end, try again next poll
+	if (!down_read_trylock(&to->mode_sem))
+		return;
 
-	for (i = 0; i < size; i++) {
-		data = (u8)start[i];
-		ddone_device_write_mem8(ddev, i, data);
+	count = size - ddev->mem_offset;
+	hlen = to->packet ? sizeof(hdr) : 0;
+	if (hlen && count > chardev_max_record(to)) {
+		up_read(&to->mode_sem);
+		pr_info("Dropping %zu byte chunk, too big to forward\n", count);
+		device_rx_release(ddev, flags);
+		return;
+	}
 
+	total = hlen + count;
+	if (ring_reserve(&to->tx, hlen ? total : 1, &total, &pos, true)) {
+		up_read(&to->mode_sem);
+		return;
 	}
-	ddev->bytes_to_write -= size;
 
-	//We transfered all data
-	ddone_device_write_reg32(ddev, FLAGS_REG, flags | DATA_READY);
-	ddone_device_write_reg32(ddev, SIZE_REG, size);
+	if (hlen) {
+		hdr.len = count;
+		hdr.flags = 0;
+		ring_copy_in(&to->tx, pos, &hdr, hlen);
+	}
+	count = total - hlen;
+	device_rx_copy(ddev, &to->tx, pos + hlen, ddev->mem_offset, count);
+	verify = (flags & DATA_CRC) && !(flags & DATA_LZ4);
+	if (verify)
+		ddev->rx_crc = ring_crc32c(&to->tx, pos + hlen, count,
+				ddev->mem_offset ? ddev->rx_crc : ~0);
+	ring_commit(&to->tx, pos, total);
+	up_read(&to->mode_sem);
+	mod_delayed_work(to->device_wq, &to->dwork, 0);
+	ddev->mem_offset += count;
+
+	if (ddev->mem_offset == size) {
+		//Already on its way out, the mismatch only shows in the stats
+		if (verify)
+			device_crc_ok_io(ddev, size, ddev->rx_crc);
+		device_rx_release(ddev, flags);
+	}
+}
+
+/*
+ * Hands a striped chunk to the aggregate if it is the next one. One that
+ * is ahead waits in its window, which is all the reordering buffer there
+ * is, while an earlier chunk is still on its way through another window.
+ * One that is behind (a duplicate, a peer restart or left over from before
+ * a rebind) would block the window for good, so it is dropped.
+ */
+static void device_stripe_rx(struct ddone_device *ddev, u32 flags,
+		size_t size)
+{
+	struct ddone_agg *agg = ddev->agg;
+	__le32 seq;
+	size_t count;
+	bool verify;
+	u64 pos;
+
+	if (size < SEQ_SIZE) {
+		device_rx_release(ddev, flags);
+		return;
+	}
+	if (ddev->rx_raw_len)
+		memcpy(&seq, ddev->rx_raw, SEQ_SIZE);
+	else
+		memcpy_fromio(&seq, ddev->mem, SEQ_SIZE);
+
+	mutex_lock(&agg->mutex);
+	if ((s32)(le32_to_cpu(seq) - agg->rx_seq) < 0) {
+		agg->rx_stale++;
+		pr_info_ratelimited("Dropping stale striped chunk %u, expecting %u (%llu)\n",
+				le32_to_cpu(seq), agg->rx_seq, agg->rx_stale);
+		device_rx_release(ddev, flags);
+		goto out;
+	}
+	if (le32_to_cpu(seq) != agg->rx_seq)
+		goto out;
+
+	verify = (flags & DATA_CRC) && !(flags & DATA_LZ4);
+	if (!ddev->mem_offset) {
+		ddev->mem_offset = SEQ_SIZE;
+		ddev->rx_crc = crc32c(~0, &seq, SEQ_SIZE);
+	}
 
-	wake_up_interruptible(&ddev->wq);//Notify writers
+	count = size - ddev->mem_offset;
+	if (count) {
+		if (ring_reserve(&agg->rx, 1, &count, &pos, true))
+			goto out;
+		device_rx_copy(ddev, &agg->rx, pos, ddev->mem_offset, count);
+		if (verify)
+			ddev->rx_crc = ring_crc32c(&agg->rx, pos, count,
+					ddev->rx_crc);
+		ring_commit(&agg->rx, pos, count);
+		ddev->mem_offset += count;
+	}
 
+	if (ddev->mem_offset == size) {
+		if (verify)
+			device_crc_ok_io(ddev, size, ddev->rx_crc);
+		agg->rx_seq++;
+		device_rx_release(ddev, flags);
+		agg_kick(agg);
+	}
+out:
+	mutex_unlock(&agg->mutex);
 }
 
 static void device_try_read_from(struct ddone_device *ddev)
 {
+	bool verify;
 	u32 flags;
-	u8 data;
 	size_t size, orig_size;
-	char *start;
-	int i;
+	u64 pos;
 
 
 
@@ -309,52 +2137,142 @@ static void device_try_read_from(struct ddone_device *ddev)
 	size = (size_t)ddone_device_read_reg32(ddev, SIZE_REG);
 
 
-	if (!(flags & DATA_READY))
+	//Our own TX chunk until the peer takes it
+	if (!(flags & DATA_READY) || (flags & DATA_TX))
 		return;
 
-	orig_size = size;
-	size -= ddev->mem_offset;
-	ring_write(ddev, &start, &size);
-
-	for (i = 0; i < size; i++) {
-		data = ddone_device_read_mem8(ddev, ddev->mem_offset);
-		ddev->mem_offset++;
+	//Arrival time, kept while the chunk waits for room in the ring
+	if (!ddev->rx_ts) {
+		ddev->rx_ts = ktime_get_ns();
+		ddev->rx_ts_raw = ktime_get_raw_ns();
+	}
 
-		start[i] = (char)data;
+	orig_size = min_t(size_t, size, MEM_SIZE);
+	if (flags & DATA_CRC) {
+		//Too short to even carry the trailer
+		if (orig_size < CRC_SIZE) {
+			WRITE_ONCE(ddev->crc_errors, ddev->crc_errors + 1);
+			device_rx_release(ddev, flags);
+			return;
+		}
+		orig_size -= CRC_SIZE;
+	}
+	if (flags & DATA_LZ4) {
+		orig_size = device_rx_inflate(ddev, orig_size, flags);
+		if (!orig_size) {
+			device_rx_release(ddev, flags);
+			return;
+		}
+		//A record never inflates past what fits a window
+		if (ddev->packet && orig_size > MEM_SIZE) {
+			pr_info_ratelimited("Dropping LZ4 record of %zu bytes\n",
+					orig_size);
+			device_rx_release(ddev, flags);
+			return;
+		}
+	}
+	if ((flags & DATA_SEQ) && ddev->agg) {
+		device_stripe_rx(ddev, flags, orig_size);
+		return;
+	}
+	if (ddev->fwd) {
+		device_forward(ddev, flags, orig_size);
+		return;
+	}
+	if (ddev->packet) {
+		device_read_record(ddev, flags, orig_size);
+		return;
 	}
 
+	size = orig_size - ddev->mem_offset;
+	//No room for readers, leave the window to the next poll
+	if (device_rx_reserve(ddev, 1, &size, &pos))
+		return;
+
+	device_rx_copy(ddev, &ddev->rx, pos, ddev->mem_offset, size);
+	verify = (flags & DATA_CRC) && !(flags & DATA_LZ4);
+	if (verify)
+		ddev->rx_crc = ring_crc32c(&ddev->rx, pos, size,
+				ddev->mem_offset ? ddev->rx_crc : ~0);
+	device_hist_append(ddev, pos, size);
+	ring_commit(&ddev->rx, pos, size);
+	ddev->mem_offset += size;
+
+	//We transfered all data
 	if (ddev->mem_offset == orig_size) {
-		//We transfered all data
-		ddone_device_write_reg32(ddev, FLAGS_REG, flags & ~DATA_READY);
-		ddev->mem_offset = 0;
+		//Too late to hold the bytes back, readers get EBADMSG once
+		if (verify)
+			device_crc_ok_io(ddev, orig_size, ddev->rx_crc);
+		device_rx_release(ddev, flags);
 	}
 
-	wake_up_interruptible(&ddev->rq);//Notify readers
+}
+
+
 
+//Next lane in the class with data, which goes to the back of the class
+static struct ddone_ring *device_lane_next(struct ddone_device *ddev,
+		int prio)
+{
+	struct ddone_file *dfile;
+
+	list_for_each_entry(dfile, &ddev->lanes[prio], lane_node) {
+		if (ring_avail(dfile->lane)) {
+			list_move_tail(&dfile->lane_node, &ddev->lanes[prio]);
+			return dfile->lane;
+		}
+	}
+	return NULL;
 }
 
+/*
+ * Picks the TX queue that fills the window next: control lanes first, then
+ * the shared ring taking turns with the bulk lanes.
+ */
+static struct ddone_ring *device_tx_next(struct ddone_device *ddev,
+		unsigned long *delay)
+{
+	struct ddone_ring *lane;
+	bool shared;
+
+	lane = device_lane_next(ddev, DDONE_PRIO_CONTROL);
+	if (lane)
+		return lane;
 
+	shared = device_tx_ready(ddev, delay);
+	if (shared && ddev->tx_turn) {
+		ddev->tx_turn = false;
+		return &ddev->tx;
+	}
+	lane = device_lane_next(ddev, DDONE_PRIO_BULK);
+	if (lane) {
+		ddev->tx_turn = true;
+		return lane;
+	}
+	return shared ? &ddev->tx : NULL;
+}
 
 static void device_work_f(struct work_struct *work)
 {
 
 	struct ddone_device *ddev;
+	struct ddone_ring *ring;
+	unsigned long delay;
 
 
 
 	ddev = container_of(work, struct ddone_device, dwork.work);
 	mutex_lock(&ddev->mutex);
-	if (ddev->bytes_to_write > 0)
-		device_try_write_to(ddev);
-	else
+	delay = ddev->poll_time;
+	ring = device_tx_next(ddev, &delay);
+	if (ring)
+		device_try_write_to(ddev, ring);
+	else if (!ddev->agg || !device_stripe_tx(ddev))
 		device_try_read_from(ddev);
 
-	queue_delayed_work(ddev->device_wq, &ddev->dwork, ddev->poll_time);
+	queue_delayed_work(ddev->device_wq, &ddev->dwork, delay);
 	mutex_unlock(&ddev->mutex);
 
-	wake_up_interruptible(&ddev->rq);//Notify readers
-	wake_up_interruptible(&ddev->wq);//Notify readers
-
 }
 
 
@@ -362,13 +2280,41 @@ static int device_remove(struct platform_device *pdev)
 {
 
 	struct ddone_device *ddev;
+	int i;
 
 	ddev = platform_get_drvdata(pdev);
 
-	destroy_workqueue(ddev->device_wq);
+	//Nobody may forward into us once our worker is gone
+	mutex_lock(&ddone_devs_lock);
+	for (i = 0; i < DEVICE_COUNT; i++) {
+		if (!ddone_devs[i] || ddone_devs[i]->fwd != ddev)
+			continue;
+		mutex_lock(&ddone_devs[i]->mutex);
+		ddone_devs[i]->fwd = NULL;
+		mutex_unlock(&ddone_devs[i]->mutex);
+	}
+	ddone_devs[MINOR(ddev->dev)] = NULL;
+	mutex_lock(&ddev->mutex);
+	mutex_lock(&ddone_agg.mutex);
+	if (ddev->agg) {
+		ddone_agg.members[MINOR(ddev->dev)] = NULL;
+		ddone_agg.nr_members--;
+		ddev->agg = NULL;
+	}
+	mutex_unlock(&ddone_agg.mutex);
+	mutex_unlock(&ddev->mutex);
+	mutex_unlock(&ddone_devs_lock);
+
 	cancel_delayed_work_sync(&ddev->dwork);
+	destroy_workqueue(ddev->device_wq);
 	cdev_del(&ddev->cdev);
 
+	mutex_lock(&ddev->mutex);
+	chardev_uring_complete(ddev, -ENODEV);
+	mutex_unlock(&ddev->mutex);
+	vfree(ddev->hist);
+	vfree(ddev->lz_wrkmem);
+
 	return 0;
 }
 
@@ -378,7 +2324,9 @@ static int device_probe(struct platform_device *pdev)
 {
 
 	struct ddone_device *ddev;
+#ifndef DDONE_EMULATE
 	struct resource *res;
+#endif
 	int err;
 
 
@@ -386,9 +2334,16 @@ static int device_probe(struct platform_device *pdev)
 			GFP_KERNEL);
 	ddev->poll_time = msecs_to_jiffies(2000);
 	mutex_init(&ddev->mutex);
-	init_waitqueue_head(&ddev->rq);
-	init_waitqueue_head(&ddev->wq);
+	mutex_init(&ddev->read_mutex);
+	init_rwsem(&ddev->hist_sem);
+	init_rwsem(&ddev->mode_sem);
+	ring_init(&ddev->tx);
+	ring_init(&ddev->rx);
 	INIT_DELAYED_WORK(&ddev->dwork, device_work_f);
+	INIT_LIST_HEAD(&ddev->tx_waiters);
+	INIT_LIST_HEAD(&ddev->readers);
+	INIT_LIST_HEAD(&ddev->lanes[DDONE_PRIO_BULK]);
+	INIT_LIST_HEAD(&ddev->lanes[DDONE_PRIO_CONTROL]);
 	ddev->device_wq = alloc_workqueue("DDONE_DRIVER_READ", WQ_UNBOUND, 1);
 	if (!ddev->device_wq) {
 		err = -ENOMEM;
@@ -396,10 +2351,17 @@ static int device_probe(struct platform_device *pdev)
 	}
 
 
+#ifdef DDONE_EMULATE
+	ddev->mem_size = MEM_SIZE - 1;
+	err = ddone_emu_map(pdev, &ddev->mem, &ddev->regs);
+	if (err)
+		goto fail;
+#else
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	pr_info("Res = %p\n", res);
 	ddev->mem_size = res->end - res->start;
-	ddev->mem = devm_ioremap_resource(&pdev->dev, res);
+	//Data window only, write-combining lets writers copy straight into it
+	ddev->mem = devm_ioremap_resource_wc(&pdev->dev, res);
 	if (IS_ERR(ddev->mem)) {
 		err = PTR_ERR(ddev->mem);
 		goto fail;
@@ -412,6 +2374,7 @@ static int device_probe(struct platform_device *pdev)
 		err = PTR_ERR(ddev->regs);
 		goto fail;
 	}
+#endif
 
 	if (DEV_MINOR == DEVICE_COUNT) {
 		err = -ENODEV;
@@ -430,6 +2393,9 @@ static int device_probe(struct platform_device *pdev)
 		goto fail;
 
 	platform_set_drvdata(pdev, ddev);
+	mutex_lock(&ddone_devs_lock);
+	ddone_devs[MINOR(ddev->dev)] = ddev;
+	mutex_unlock(&ddone_devs_lock);
 
 	queue_delayed_work(ddev->device_wq, &ddev->dwork, 0);
 
@@ -453,16 +2419,31 @@ int __init setup_driver(void)
 	int err;
 	dev_t dev;
 
-	err = alloc_chrdev_region(&dev, 0, (int)DEVICE_COUNT, DEVICE_NAME);
+	err = alloc_chrdev_region(&dev, 0, (int)MINOR_COUNT, DEVICE_NAME);
 	if (err)
 		goto err_setup;
 	DEV_MAJOR = MAJOR(dev);
 	DEV_MINOR = MINOR(dev);
+
+	mutex_init(&ddone_agg.mutex);
+	mutex_init(&ddone_agg.read_mutex);
+	ring_init(&ddone_agg.tx);
+	ring_init(&ddone_agg.rx);
+	cdev_init(&ddone_agg.cdev, &agg_fops);
+	ddone_agg.cdev.owner = THIS_MODULE;
+	err = cdev_add(&ddone_agg.cdev, MKDEV(DEV_MAJOR, AGG_MINOR), 1);
+	if (err)
+		goto err_region;
+
 	err = platform_driver_register(&ddone_driver);
 	if (err)
-		goto err_setup;
+		goto err_cdev;
 	pr_info("Driver registered\n");
 	return 0;
+err_cdev:
+	cdev_del(&ddone_agg.cdev);
+err_region:
+	unregister_chrdev_region(MKDEV(DEV_MAJOR, 0), MINOR_COUNT);
 err_setup:
 	pr_info("Error registering driver");
 	return err;
@@ -470,6 +2451,7 @@ err_setup:
 
 void remove_driver(void)
 {
-	unregister_chrdev_region(MKDEV(DEV_MAJOR, 0), DEVICE_COUNT);
+	cdev_del(&ddone_agg.cdev);
+	unregister_chrdev_region(MKDEV(DEV_MAJOR, 0), MINOR_COUNT);
 	platform_driver_unregister(&ddone_driver);
 }
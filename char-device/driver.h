@@ -5,14 +5,21 @@
 #include <linux/init.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/crc32c.h>
 
 #include "device.h"
 #include "ioctl.h"
+#include "ring.h"
 
 
 #define MAX_POLL_INTERVAL 10000
 #define MIN_POLL_INTERVAL 1
+#define MAX_HISTORY_SIZE (256 << 20)
+#define MAX_COALESCE_TIMEOUT 10000
 
 int __init setup_driver(void);
 void remove_driver(void);
@@ -23,27 +30,109 @@ enum minors{
 	DEVICE_2,
 	DEVICE_COUNT
 };
+#define AGG_MINOR DEVICE_COUNT//Striped aggregate of the probed devices
+#define MINOR_COUNT (DEVICE_COUNT + 1)
 extern unsigned int DEV_MAJOR;
 extern unsigned int DEV_MINOR;
 
+struct ddone_device;
+
+/*
+ * Stripes one stream over the windows of its members. Each member worker
+ * takes the next chunk of tx when its window is free, RX chunks are taken
+ * in sequence order and the rest wait in their windows meanwhile.
+ */
+struct ddone_agg {
+	struct cdev cdev;
+	struct mutex mutex;//Members, sequence numbers and the tx consumer
+	struct mutex read_mutex;
+	struct ddone_ring tx, rx;
+	struct ddone_device *members[DEVICE_COUNT];
+	int nr_members;
+	u32 tx_seq, rx_seq;
+	u64 rx_stale;//Chunks dropped for a sequence number already taken
+};
+
 struct ddone_device{
 	struct platform_device *pdev;
 	struct workqueue_struct *device_wq;
 	void __iomem *mem;
 	void __iomem *regs;
 	struct cdev cdev;
-	struct mutex mutex;
+	struct mutex mutex;//Window and worker
+	struct mutex read_mutex;//Serializes readers on the RX ring
 	struct delayed_work dwork;
 	int major;
-	int r, w; //Read and write pointers to cyclic buffer
 	size_t mem_size;
-	size_t bytes_to_write;
+	struct ddone_ring tx, rx;//tx.rpos counts bytes pushed to the window
+	struct ddone_device *fwd;//RX goes to its TX ring, under mutex
+	struct ddone_agg *agg;//Striping member, under mutex and agg->mutex
+	struct list_head lanes[DDONE_PRIO_COUNT];//struct ddone_file, under mutex
+	bool tx_turn;//Shared ring is next among the bulk writers
+	struct list_head tx_waiters;//uring_cmd waiting for tx.rpos
+	u64 tx_flush;//Push up to here without coalescing, under tx.lock
+	size_t tx_low;//Stream mode holds TX data below this, 0 - off
+	unsigned long tx_delay;//For at most this many jiffies
+	unsigned long tx_deadline;
+	bool tx_held;//tx_deadline is running
+	void *lz_wrkmem;//LZ4 state for TX chunks, NULL - send raw
+	char lz_src[BUF_SIZE], lz_dst[MEM_SIZE];
+	char rx_lz[MEM_SIZE], rx_raw[BUF_SIZE];//RX chunk and what it inflated to
+	size_t rx_raw_len;
+	bool tx_crc;//Append a CRC32C trailer to TX chunks
+	u32 rx_crc;//Over the part of the RX chunk copied so far
+	u64 crc_tx, crc_rx, crc_errors;//Chunks sealed, checked and bad
+	struct list_head readers;//struct ddone_file opened for reading
+	u32 fanout;//DDONE_FANOUT_*, changed under read_mutex
 	size_t mem_offset;
-	char data[BUF_SIZE + 1];
+	bool packet;//Record framing in both rings, see DDONE_SET_MODE
+	struct rw_semaphore mode_sem;//Held shared while packet frames a write
+	bool rx_packet;//Copy of packet for readers, under read_mutex
+	bool rx_tstamp;//Prefix records with struct ddone_rx_info on read
+	u64 rx_ts, rx_ts_raw;//When the chunk in the window was first seen
+	/*
+	 * Copy of the last hist_size RX payload bytes, addressed by stream
+	 * offset. The worker moves head before and tail after writing, so
+	 * lockless readers can tell when they were overtaken.
+	 */
+	struct rw_semaphore hist_sem;//Buffer lifetime
+	char *hist;
+	size_t hist_size;
+	u64 hist_start, hist_head, hist_tail;
 	u64 poll_time;
-	wait_queue_head_t rq, wq;//Read and write queues
 	dev_t dev;
 };
 
+//Per open file, rpos is its own RX cursor in fan-out mode
+struct ddone_file {
+	struct ddone_device *ddev;
+	struct list_head node;//On ddev->readers, under read_mutex
+	u64 rpos;//Under rx.lock
+	u64 dropped;//Bytes skipped by DDONE_FANOUT_DROP
+	bool history;//Reads go to the history at f_pos after an lseek()
+	u64 crc_errors;//Stream mode mismatches already reported to the file
+	struct ddone_ring *lane;//Own TX queue once DDONE_SET_PRIO was used
+	struct list_head lane_node;//On ddev->lanes[prio]
+};
+
+//Precedes every record in the rings in packet mode
+struct ddone_rec_hdr {
+	u32 len;
+	u32 flags;//DDONE_MSG_* handed to the reader
+};
+
+//RX records also carry the time the chunk showed up in the window
+struct ddone_rx_hdr {
+	struct ddone_rec_hdr rec;
+	u64 ts, ts_raw;
+};
+
+//Lives in io_uring_cmd pdu while a command waits for its data to be pushed
+struct ddone_uring_pdu {
+	struct list_head node;
+	u64 target;
+	s64 res;
+};
+
 
 #endif
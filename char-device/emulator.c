@@ -0,0 +1,150 @@
+#include <linux/errno.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+
+#include "device.h"
+
+/*
+ * RAM backed ddone windows with a software peer, built with EMULATE=y.
+ * The peer is an hrtimer that looks at the window once per period: a TX
+ * chunk is taken after it was visible for the latency (or handed straight
+ * back as RX in loopback mode), a free window gets a generated RX chunk.
+ * The free window has no owner, so a driver TX racing a generated chunk
+ * corrupts both just like on the board, pick either direction for clean
+ * numbers.
+ */
+
+static unsigned int emu_period_us = 100;
+module_param(emu_period_us, uint, 0644);
+MODULE_PARM_DESC(emu_period_us, "Peer tick, at most one chunk per tick");
+
+static unsigned int emu_latency_us;
+module_param(emu_latency_us, uint, 0644);
+MODULE_PARM_DESC(emu_latency_us, "Time a TX chunk stays in the window");
+
+static unsigned int emu_rx_size;
+module_param(emu_rx_size, uint, 0644);
+MODULE_PARM_DESC(emu_rx_size, "Generate RX chunks of this size, 0 is off");
+
+static bool emu_loopback;
+module_param(emu_loopback, bool, 0644);
+MODULE_PARM_DESC(emu_loopback, "Return TX chunks as RX");
+
+struct ddone_emu {
+	struct platform_device *pdev;
+	struct hrtimer timer;
+	void __iomem *mem;
+	void __iomem *regs;
+	u64 seen;
+	u64 tx_chunks;
+	u64 tx_bytes;
+	u64 rx_chunks;
+	u64 rx_bytes;
+};
+
+static ktime_t ddone_emu_period(void)
+{
+	return ns_to_ktime((u64)max(emu_period_us, 1U) * NSEC_PER_USEC);
+}
+
+//Chunk n carries bytes n, n + 1, ... so a reader can check the stream
+static void ddone_emu_produce(struct ddone_emu *emu)
+{
+	size_t size = min_t(size_t, emu_rx_size, MEM_SIZE);
+	u8 seed = emu->rx_chunks;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		iowrite8(seed + i, emu->mem + i);
+	iowrite32(size, emu->regs + SIZE_REG);
+	wmb();
+	iowrite32(DATA_READY, emu->regs + FLAGS_REG);
+
+	emu->rx_chunks++;
+	emu->rx_bytes += size;
+}
+
+static enum hrtimer_restart ddone_emu_tick(struct hrtimer *timer)
+{
+	struct ddone_emu *emu = container_of(timer, struct ddone_emu, timer);
+	u64 now = ktime_get_ns();
+	u32 flags;
+
+	flags = ioread32(emu->regs + FLAGS_REG);
+	if (flags & DATA_READY) {
+		//RX chunk still waiting for the driver
+		if (!(flags & DATA_TX))
+			goto out;
+
+		if (!emu->seen)
+			emu->seen = now;
+		if (now - emu->seen < (u64)emu_latency_us * NSEC_PER_USEC)
+			goto out;
+		emu->seen = 0;
+
+		emu->tx_chunks++;
+		emu->tx_bytes += ioread32(emu->regs + SIZE_REG);
+		//Same size and flags, so the driver sees its own chunk come back
+		if (emu_loopback)
+			iowrite32(flags & ~DATA_TX, emu->regs + FLAGS_REG);
+		else
+			iowrite32(0, emu->regs + FLAGS_REG);
+		goto out;
+	}
+
+	if (emu_rx_size && !emu_loopback)
+		ddone_emu_produce(emu);
+
+out:
+	hrtimer_forward_now(timer, ddone_emu_period());
+	return HRTIMER_RESTART;
+}
+
+static void ddone_emu_stop(void *data)
+{
+	struct ddone_emu *emu = data;
+
+	hrtimer_cancel(&emu->timer);
+	pr_info("%s: TX %llu chunks %llu bytes, RX %llu chunks %llu bytes\n",
+			dev_name(&emu->pdev->dev), emu->tx_chunks, emu->tx_bytes,
+			emu->rx_chunks, emu->rx_bytes);
+}
+
+//Stands in for mapping the MEM and REG resources, the peer stops on unbind
+int ddone_emu_map(struct platform_device *pdev, void __iomem **mem,
+		void __iomem **regs)
+{
+	struct ddone_emu *emu;
+	int err;
+
+	emu = devm_kzalloc(&pdev->dev, sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		return -ENOMEM;
+	emu->pdev = pdev;
+	emu->mem = (void __iomem *)devm_kzalloc(&pdev->dev, MEM_SIZE,
+			GFP_KERNEL);
+	emu->regs = (void __iomem *)devm_kzalloc(&pdev->dev, REG_SIZE,
+			GFP_KERNEL);
+	if (!emu->mem || !emu->regs)
+		return -ENOMEM;
+
+	hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	emu->timer.function = ddone_emu_tick;
+	hrtimer_start(&emu->timer, ddone_emu_period(), HRTIMER_MODE_REL);
+
+	err = devm_add_action_or_reset(&pdev->dev, ddone_emu_stop, emu);
+	if (err)
+		return err;
+
+	*mem = emu->mem;
+	*regs = emu->regs;
+	pr_info("%s: emulated, period %uus latency %uus rx %u%s\n",
+			dev_name(&pdev->dev), emu_period_us, emu_latency_us,
+			emu_rx_size, emu_loopback ? " loopback" : "");
+	return 0;
+}
@@ -3,11 +3,16 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <lz4.h>
+#include <endian.h>
 
 
 #define MEM_BASE1  0x60000000
@@ -21,16 +26,26 @@
 #define PLAT_IO_FLAG_REG		(0) /*Offset of flag register*/
 #define PLAT_IO_SIZE_REG		(4) /*Offset of flag register*/
 #define PLAT_IO_DATA_READY	(1) /*IO data ready flag */
+#define PLAT_IO_LZ4		(2) /*Chunk is an LZ4 block */
+#define PLAT_IO_CRC		(4) /*Last CRC_SIZE bytes are a LE CRC32C */
+#define PLAT_IO_SEQ		(8) /*Striped chunk, starts with LE u32 sequence */
+#define PLAT_IO_TX		(16) /*Chunk comes from the driver */
+#define SEQ_SIZE		4
+#define CRC_SIZE		4
 
-#define MAX_DEVICES	2
+#define MAX_RAW		2048 /*Largest chunk the driver compresses */
+#define OUT_SIZE	(1 << 20) /*Output is written in blocks this big */
+#define SPINS		2000 /*Flag reads before the first sleep */
+#define MIN_SLEEP_US	10
+#define MAX_SLEEP_US	50000
 
-extern int errno;
+#define MAX_DEVICES	2
 
 struct my_device {
 	uint32_t mem_base;
 	uint32_t mem_size;
 	uint32_t reg_base;
-	uint32_t reg_size;	
+	uint32_t reg_size;
 };
 
 static struct my_device my_devices[MAX_DEVICES] = {{
@@ -46,77 +61,379 @@ static struct my_device my_devices[MAX_DEVICES] = {{
 	.reg_size = REG_SIZE,
 	},
 };
+
+struct capture {
+	pthread_t thread;
+	unsigned int window;
+	volatile unsigned int *flag_addr;
+	volatile unsigned int *count_addr;
+	volatile unsigned char *mem_addr;
+	int out;
+	uint8_t *obuf;
+	size_t olen;
+	unsigned int idle;
+	uint64_t chunks;
+	uint64_t bytes;
+	uint64_t bad;
+	uint64_t stale;
+	uint64_t sleeps;
+};
+
+static volatile sig_atomic_t stop;
+static unsigned int max_sleep_us = MAX_SLEEP_US;
+static uint32_t crc_table[256];
+
 int usage(char **argv)
 {
-	printf("Program sends file to the specific device\n");
-	printf("Usage: %s <device> <file>\n", argv[0]);
+	printf("Program captures what the driver sends into files\n");
+	printf("Usage: %s [-p <us>] <devices> <file>\n", argv[0]);
+	printf("       %s [-p <us>] -a <windows> <file>\n", argv[0]);
+	printf("  <devices>  One window or a list like 0,1, captured at once\n");
+	printf("             into <file>.0, <file>.1, ...\n");
+	printf("  -a  Reassemble a stream striped over the first <windows> devices\n");
+	printf("  -p  Longest sleep between polls once idle (default %d)\n",
+			MAX_SLEEP_US);
+	printf("Runs until SIGINT/SIGTERM or an empty chunk\n");
 	return -1;
 }
 
-int main(int argc, char **argv)
+static void on_signal(int sig)
 {
-	volatile unsigned int *reg_addr = NULL, *count_addr, *flag_addr;
-	volatile unsigned char *mem_addr = NULL;
-	unsigned int i, device, ret, len, count;
-	struct stat st;
-	uint8_t *buf;
-	FILE *f;
-
-	if (argc != 3) {
-		return usage(argv);
+	stop = 1;
+}
+
+static void crc32c_init(void)
+{
+	uint32_t crc, i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc_table[i] = crc;
 	}
+}
 
-	device = atoi(argv[1]);
-	if (device >= MAX_DEVICES)
-		return usage(argv);
+static uint32_t crc32c(const uint8_t *buf, size_t len)
+{
+	uint32_t crc = ~0;
+
+	while (len--)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+//Strips the trailer off a sealed chunk, returns the length left or -1
+static int chunk_unseal(const uint8_t *buf, unsigned int count,
+		unsigned int flags)
+{
+	uint32_t le;
+
+	if (!(flags & PLAT_IO_CRC))
+		return count;
+	if (count < CRC_SIZE)
+		return -1;
+	count -= CRC_SIZE;
+	memcpy(&le, buf + count, CRC_SIZE);
+	return le32toh(le) == crc32c(buf, count) ? (int)count : -1;
+}
+
+/*
+ * Spin first, a busy stream refills the window in microseconds. Once it
+ * stays empty back off to sleeps of up to max_sleep_us.
+ */
+static void capture_idle(struct capture *cap)
+{
+	unsigned int us;
+
+	if (++cap->idle < SPINS)
+		return;
+	us = MIN_SLEEP_US << ((cap->idle - SPINS) < 12 ?
+			(cap->idle - SPINS) : 12);
+	usleep(us < max_sleep_us ? us : max_sleep_us);
+	cap->sleeps++;
+}
+
+static int capture_flush(struct capture *cap)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < cap->olen) {
+		ret = write(cap->out, cap->obuf + done, cap->olen - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("write error on window %u\n", cap->window);
+			return -1;
+		}
+		done += ret;
+	}
+	cap->olen = 0;
+	return 0;
+}
+
+/*
+ * Copies a chunk straight into the output block, inflating LZ4 ones on the
+ * way, and hands the window back. Returns 0 on an empty chunk.
+ */
+static int capture_chunk(struct capture *cap, unsigned int flags)
+{
+	uint8_t chunk[MEM_SIZE], *dst = cap->obuf + cap->olen;
+	unsigned int count = *cap->count_addr;
+	int len;
+
+	if (!count || count > MEM_SIZE) {
+		*cap->flag_addr = 0;
+		if (!count)
+			return 0;
+		cap->bad++;
+		return 1;
+	}
+	memcpy(flags & (PLAT_IO_LZ4 | PLAT_IO_CRC) ? chunk : dst,
+			(void *)cap->mem_addr, count);
+	*cap->flag_addr = 0;
+	cap->chunks++;
+
+	if (!(flags & (PLAT_IO_LZ4 | PLAT_IO_CRC))) {
+		len = count;
+	} else {
+		len = chunk_unseal(chunk, count, flags);
+		if (len >= 0 && (flags & PLAT_IO_LZ4))
+			len = LZ4_decompress_safe((char *)chunk, (char *)dst,
+					len, MAX_RAW);
+		else if (len > 0)
+			memcpy(dst, chunk, len);
+	}
+	if (len < 0) {
+		cap->bad++;
+		return 1;
+	}
+	cap->olen += len;
+	cap->bytes += len;
+	//Always room for one more inflated chunk
+	if (cap->olen > OUT_SIZE - MAX_RAW && capture_flush(cap))
+		return -1;
+	return 1;
+}
+
+static void *capture_window(void *arg)
+{
+	struct capture *cap = arg;
+	unsigned int flags;
+	int ret;
 
-	buf = (uint8_t *) malloc(MEM_SIZE);
-	if (!buf) {
+	while (!stop) {
+		flags = *cap->flag_addr;
+		//Chunks without the TX flag are ours for the driver
+		if ((flags & (PLAT_IO_DATA_READY | PLAT_IO_TX)) !=
+				(PLAT_IO_DATA_READY | PLAT_IO_TX)) {
+			capture_idle(cap);
+			continue;
+		}
+		cap->idle = 0;
+		ret = capture_chunk(cap, flags);
+		if (ret <= 0)
+			break;
+	}
+	capture_flush(cap);
+	return NULL;
+}
+
+static int map_window(struct capture *cap, int fd, unsigned int window)
+{
+	cap->window = window;
+	cap->mem_addr = mmap(0, my_devices[window].mem_size, PROT_READ,
+			MAP_SHARED, fd, my_devices[window].mem_base);
+	cap->flag_addr = mmap(0, my_devices[window].reg_size,
+			PROT_WRITE | PROT_READ, MAP_SHARED, fd,
+			my_devices[window].reg_base);
+	if (cap->mem_addr == MAP_FAILED || cap->flag_addr == MAP_FAILED) {
+		printf("Can't mmap\n");
+		return -1;
+	}
+	cap->count_addr = cap->flag_addr + 1;
+	cap->obuf = malloc(OUT_SIZE);
+	if (!cap->obuf) {
 		printf("ERROR: Out of memory");
 		return -1;
 	}
+	return 0;
+}
+
+static int open_out(const char *path)
+{
+	int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (out < 0)
+		printf("open error (%s)\n", path);
+	return out;
+}
+
+static void report(const struct capture *cap)
+{
+	fprintf(stderr, "window %u: %llu chunks, %llu bytes, %llu bad, "
+			"%llu stale, %llu sleeps\n", cap->window,
+			(unsigned long long)cap->chunks,
+			(unsigned long long)cap->bytes,
+			(unsigned long long)cap->bad,
+			(unsigned long long)cap->stale,
+			(unsigned long long)cap->sleeps);
+}
+
+/*
+ * Takes chunks in sequence order, a chunk that is ahead stays in its
+ * window until the ones before it showed up. One that is behind (a
+ * duplicate) is dropped, or it would hold its window for good. An empty
+ * chunk ends the stream.
+ */
+int get_striped(int fd, unsigned int windows, const char *path)
+{
+	struct capture caps[MAX_DEVICES], *cap, *out = &caps[0];
+	unsigned int i, count, flags, found;
+	uint8_t chunk[MEM_SIZE];
+	uint32_t seq = 0, le;
+	int len;
+
+	memset(caps, 0, sizeof(caps));
+	for (i = 0; i < windows; i++) {
+		if (map_window(&caps[i], fd, i))
+			return -1;
+	}
+	out->out = open_out(path);
+	if (out->out < 0)
+		return -1;
+
+	while (!stop) {
+		found = 0;
+		for (i = 0; i < windows; i++) {
+			cap = &caps[i];
+			flags = *cap->flag_addr;
+			if ((flags & (PLAT_IO_DATA_READY | PLAT_IO_TX)) !=
+					(PLAT_IO_DATA_READY | PLAT_IO_TX))
+				continue;
+			count = *cap->count_addr;
+			if (!count) {
+				stop = 1;
+				break;
+			}
+			if (!(flags & PLAT_IO_SEQ) || count > MEM_SIZE)
+				continue;
+			memcpy(&le, (void *)cap->mem_addr, SEQ_SIZE);
+			if ((int32_t)(le32toh(le) - seq) < 0) {
+				*cap->flag_addr = 0;
+				cap->stale++;
+				continue;
+			}
+			if (le32toh(le) != seq)
+				continue;
+			memcpy(chunk, (void *)cap->mem_addr, count);
+			*cap->flag_addr = 0;
+			cap->chunks++;
+			seq++;
+			found = 1;
+
+			len = chunk_unseal(chunk, count, flags);
+			if (len < SEQ_SIZE) {
+				cap->bad++;
+				continue;
+			}
+			memcpy(out->obuf + out->olen, chunk + SEQ_SIZE,
+					len - SEQ_SIZE);
+			out->olen += len - SEQ_SIZE;
+			cap->bytes += len - SEQ_SIZE;
+			if (out->olen > OUT_SIZE - MEM_SIZE &&
+					capture_flush(out))
+				return -1;
+		}
+		if (found)
+			caps[0].idle = 0;
+		else
+			capture_idle(&caps[0]);
+	}
+	capture_flush(out);
+	for (i = 0; i < windows; i++)
+		report(&caps[i]);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct capture caps[MAX_DEVICES];
+	unsigned int i, nr = 0, striped = 0;
+	struct sigaction sa;
+	char path[4096];
+	char *list, *tok;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "ap:")) != -1) {
+		switch (opt) {
+		case 'a': striped = 1; break;
+		case 'p': max_sleep_us = atoi(optarg); break;
+		default: return usage(argv);
+		}
+	}
+	if (optind != argc - 2 || !max_sleep_us)
+		return usage(argv);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	crc32c_init();
 
-	//len = fread(buf, 1U, st.st_size, f);
-	int fd = open("/dev/mem",O_RDWR|O_SYNC);
+	fd = open("/dev/mem",O_RDWR|O_SYNC);
 	if(fd < 0)
 	{
 		printf("Can't open /dev/mem\n");
 		return -1;
 	}
-	mem_addr = (unsigned char *) mmap(0, my_devices[device].mem_size,
-				PROT_WRITE, MAP_SHARED, fd, my_devices[device].mem_base);
-	if(mem_addr == NULL)
-	{
-		printf("Can't mmap\n");
-		return -1;
+	if (striped) {
+		nr = atoi(argv[optind]);
+		if (!nr || nr > MAX_DEVICES)
+			return usage(argv);
+		return get_striped(fd, nr, argv[optind + 1]);
 	}
 
-	reg_addr = (unsigned int *) mmap(0, my_devices[device].reg_size,
-			PROT_WRITE | PROT_READ, MAP_SHARED, fd, my_devices[device].reg_base);
+	memset(caps, 0, sizeof(caps));
+	list = argv[optind];
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		i = atoi(tok);
+		if (i >= MAX_DEVICES || nr == MAX_DEVICES)
+			return usage(argv);
+		if (map_window(&caps[nr], fd, i))
+			return -1;
+		nr++;
+	}
+	if (!nr)
+		return usage(argv);
 
-	flag_addr = reg_addr;
-	count_addr = reg_addr;
-	count_addr++;
-	f = fopen(argv[2], "wb");
-	fclose(f);
+	for (i = 0; i < nr; i++) {
+		if (nr == 1)
+			snprintf(path, sizeof(path), "%s", argv[optind + 1]);
+		else
+			snprintf(path, sizeof(path), "%s.%u",
+					argv[optind + 1], caps[i].window);
+		caps[i].out = open_out(path);
+		if (caps[i].out < 0)
+			return -1;
+	}
 
-	while (1) {
-		while (!(*flag_addr & PLAT_IO_DATA_READY)) {
-			usleep(50000);
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&caps[i].thread, NULL, capture_window,
+					&caps[i])) {
+			printf("Can't start capture of window %u\n",
+					caps[i].window);
+			stop = 1;
+			nr = i;
+			break;
 		}
-		count = *count_addr;
-		printf("Copying\n");
-		if(count == 0) break;
-		memcpy((void *)buf, (void*)mem_addr, count);
-		printf("Copying %.*s\n",count,buf);
-		*count_addr = 0;
-		*flag_addr = 0;
-		//printf("Fwrite %d\n",count);
-		f = fopen(argv[2], "a+b");
-		fwrite(buf,1U,count,f);
-		fclose(f);
+	}
+	for (i = 0; i < nr; i++) {
+		pthread_join(caps[i].thread, NULL);
+		close(caps[i].out);
+		report(&caps[i]);
 	}
 
 	return 0;
 }
-
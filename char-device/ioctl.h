@@ -2,8 +2,146 @@
 #define IOCTL_H
 
 #define DDONE_IOC_MAGIC 'x'
-#define DDONE_IOC_MAXNR 1
+#define DDONE_IOC_MAXNR 16
 #define DDONE_SET_POLL _IOW(DDONE_IOC_MAGIC,1,uint32_t)
+#define DDONE_SET_MODE _IOW(DDONE_IOC_MAGIC,2,uint32_t)
+#define DDONE_RECV_BATCH _IOWR(DDONE_IOC_MAGIC,3,struct ddone_batch)
+#define DDONE_SEND_BATCH _IOWR(DDONE_IOC_MAGIC,4,struct ddone_batch)
+#define DDONE_SET_TSTAMP _IOW(DDONE_IOC_MAGIC,5,uint32_t)
+#define DDONE_SET_FANOUT _IOW(DDONE_IOC_MAGIC,6,uint32_t)
+#define DDONE_GET_DROPPED _IOR(DDONE_IOC_MAGIC,7,uint64_t)
+/*
+ * Keeps the last arg bytes (rounded up to a power of two, 0 - off) of RX
+ * payload. After lseek() a file reads it by stream offset, pread() works
+ * too, SEEK_END is the newest byte. Offsets that were overwritten fail
+ * with ENODATA, reading past the end waits like a normal read. lseek()
+ * fails with ESPIPE while there is no history. Until the first lseek()
+ * pread() ignores its offset and reads live data, after it the file reads
+ * history until it is closed, and DDONE_RECV_BATCH fails with EINVAL.
+ */
+#define DDONE_SET_HISTORY _IOW(DDONE_IOC_MAGIC,8,uint32_t)
+/*
+ * Stream mode: keeps TX data back until bytes are queued or timeout_ms
+ * passed. DDONE_FLUSH and O_DSYNC/RWF_DSYNC writes push right away.
+ */
+#define DDONE_SET_COALESCE _IOW(DDONE_IOC_MAGIC,9,struct ddone_coalesce)
+#define DDONE_FLUSH _IO(DDONE_IOC_MAGIC,10)
+#define DDONE_SET_COMPRESS _IOW(DDONE_IOC_MAGIC,11,uint32_t)
+/*
+ * Seals TX chunks with a CRC32C trailer, RX checks every sealed chunk.
+ * A bad record fails read() with EBADMSG, in stream mode the next read()
+ * of each reader fails once instead. Turning it on fails with EBUSY while
+ * writes are in flight, in packet mode also while TX records are queued.
+ */
+#define DDONE_SET_CRC _IOW(DDONE_IOC_MAGIC,12,uint32_t)
+#define DDONE_GET_CRC_STATS _IOR(DDONE_IOC_MAGIC,13,struct ddone_crc_stats)
+/*
+ * Sends every RX chunk out of the device with minor arg instead of to
+ * readers, DDONE_FORWARD_OFF hands RX back to them.
+ */
+#define DDONE_SET_FORWARD _IOW(DDONE_IOC_MAGIC,14,uint32_t)
+#define DDONE_FORWARD_OFF	0xffffffff
+/*
+ * On the aggregate device: stripes it over the minors in the arg bitmask,
+ * 0 - none. Restarts sequence numbers, so the peer has to restart too.
+ */
+#define DDONE_SET_STRIPE _IOW(DDONE_IOC_MAGIC,15,uint32_t)
+/*
+ * Gives the file its own TX queue in class arg. The worker fills the window
+ * from control queues first, round robin among writers within a class.
+ * Files that never set it share one queue that takes turns with the bulk
+ * ones, batch and io_uring submissions always go there.
+ */
+#define DDONE_SET_PRIO _IOW(DDONE_IOC_MAGIC,16,uint32_t)
+
+//DDONE_SET_MODE values, only accepted while nothing is buffered or being written
+#define DDONE_MODE_STREAM	0 //Byte stream, chunk boundaries are lost
+#define DDONE_MODE_PACKET	1 //Each write and window chunk is one record
+
+/*
+ * DDONE_SET_COMPRESS values for TX chunks. Each chunk is flagged in the
+ * FLAGS register, so RX inflates whatever the peer sends either way.
+ */
+#define DDONE_COMPRESS_NONE	0
+#define DDONE_COMPRESS_LZ4	1
+
+//DDONE_SET_PRIO classes
+#define DDONE_PRIO_BULK		0
+#define DDONE_PRIO_CONTROL	1
+#define DDONE_PRIO_COUNT	2
+
+//DDONE_SET_FANOUT values, DDONE_GET_DROPPED returns bytes this file lost
+#define DDONE_FANOUT_OFF	0 //Readers share one cursor and split the data
+#define DDONE_FANOUT_BLOCK	1 //Every reader sees all data, the slowest holds the ring
+#define DDONE_FANOUT_DROP	2 //Every reader sees all data, laggards lose the oldest
+
+/*
+ * io_uring IORING_OP_URING_CMD opcodes, put into sqe->cmd_op. Unlike
+ * DDONE_SEND_BATCH, SUBMIT completes with the payload bytes queued, not the
+ * number of messages. TX_WAIT counts bytes of the TX ring, which in packet
+ * mode include the 8 byte header queued before each record, so a target
+ * taken from summed message lengths falls short there.
+ */
+#define DDONE_URING_CMD_SUBMIT	1 //Queue arg/nr array of struct ddone_msg
+#define DDONE_URING_CMD_TX_WAIT	2 //Complete once arg bytes were pushed (0 - all queued so far)
+
+#define DDONE_URING_F_PUSHED	(1 << 0) //SUBMIT completes when its data left the ring
+
+#define DDONE_MAX_MSGS	1024
+#define DDONE_MSG_TRUNC	(1 << 0) //Record did not fit, the rest was dropped
+#define DDONE_MSG_BADCRC	(1 << 1) //Record failed its CRC32C check
+
+//One buffer of a batch, len and flags are updated by DDONE_RECV_BATCH
+struct ddone_msg {
+	uint64_t buf;
+	uint32_t len;
+	uint32_t flags;
+};
+
+//CLOCK_MONOTONIC and CLOCK_MONOTONIC_RAW ns when a chunk hit the window
+struct ddone_stamp {
+	uint64_t ts;
+	uint64_t ts_raw;
+};
+
+/*
+ * Batch ioctls return the number of messages done and store it in nr.
+ * Without blocking SEND stops at the first message the TX ring has no room
+ * for, -EAGAIN if that is the first one, -EMSGSIZE if it never fits.
+ */
+struct ddone_batch {
+	uint64_t msgs; //Array of struct ddone_msg
+	uint64_t stamps; //Optional struct ddone_stamp array for RECV, packet mode
+	uint32_t nr;
+	uint32_t pad;
+};
+
+//Precedes each record returned by read() in packet mode after DDONE_SET_TSTAMP
+struct ddone_rx_info {
+	uint64_t ts;
+	uint64_t ts_raw;
+	uint32_t len; //Record length, may be more than what was returned
+	uint32_t flags;
+};
+
+struct ddone_crc_stats {
+	uint64_t tx_chunks; //Sealed
+	uint64_t rx_chunks; //Checked
+	uint64_t rx_errors; //Failed the check
+};
+
+//bytes is capped at the window size, 0 turns coalescing off
+struct ddone_coalesce {
+	uint32_t bytes;
+	uint32_t timeout_ms;
+};
+
+//Fits into the 16 byte sqe->cmd area
+struct ddone_uring_cmd {
+	uint64_t arg;
+	uint32_t nr;
+	uint32_t flags;
+};
 
 
 #endif
@@ -0,0 +1,404 @@
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ioctl.h"
+#include "load.h"
+
+#define MEM_BASE1  0x60000000
+#define REG_BASE1  0x60001000
+#define MEM_BASE2  0x60002000
+#define REG_BASE2  0x60003000
+
+#define MEM_SIZE	1024
+#define REG_SIZE	8
+
+#define PLAT_IO_DATA_READY	(1) /*IO data ready flag */
+
+#define MAX_DEVICES	2
+#define MAX_TRACE	(1 << 20)
+
+enum { SHAPE_FLAT, SHAPE_RATE, SHAPE_BURST, SHAPE_TRACE };
+
+struct my_device {
+	uint32_t mem_base;
+	uint32_t mem_size;
+	uint32_t reg_base;
+	uint32_t reg_size;
+};
+
+static struct my_device my_devices[MAX_DEVICES] = {{
+	.mem_base = MEM_BASE1,
+	.mem_size = MEM_SIZE,
+	.reg_base = REG_BASE1,
+	.reg_size = REG_SIZE,
+	},
+	{
+	.mem_base = MEM_BASE2,
+	.mem_size = MEM_SIZE,
+	.reg_base = REG_BASE2,
+	.reg_size = REG_SIZE,
+	},
+};
+
+struct load_cfg {
+	const char *dev;
+	int window; /*-1 - write /dev/dN instead */
+	unsigned int streams;
+	unsigned int size;
+	unsigned int shape;
+	double rate;
+	unsigned int burst;
+	unsigned int gap_us;
+	uint32_t *trace;
+	size_t trace_nr;
+	uint64_t count;
+	unsigned int seconds;
+	int packet;
+	FILE *log;
+};
+
+//The peer side of one window, streams take turns on it
+struct load_window {
+	pthread_mutex_t lock;
+	volatile unsigned int *flag_addr;
+	volatile unsigned int *count_addr;
+	volatile unsigned char *mem_addr;
+};
+
+struct load_stream {
+	pthread_t thread;
+	const struct load_cfg *cfg;
+	struct load_window *win;
+	pthread_mutex_t *dev_lock;
+	unsigned int id;
+	int fd;
+	uint64_t sent;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t max_lag_ns;
+};
+
+int usage(char **argv)
+{
+	printf("Program sends numbered messages at a set pace\n");
+	printf("Usage: %s [options] <device>\n", argv[0]);
+	printf("       %s [options] -w <window>\n", argv[0]);
+	printf("  -w <n>          Be the peer on window n through /dev/mem\n");
+	printf("  -S <streams>    Concurrent streams (default 1, max %d)\n",
+			LOAD_MAX_STREAMS);
+	printf("  -s <bytes>      Message size, header included (default 256,\n");
+	printf("                  at most %d with -w or -P)\n", MEM_SIZE);
+	printf("  -r <msgs/s>     Fixed rate per stream\n");
+	printf("  -b <n>:<us>     Bursts of n messages, <us> apart\n");
+	printf("  -T <file>       Replay inter-arrival gaps in us, one per line\n");
+	printf("  -c <count>      Messages per stream (default 1000)\n");
+	printf("  -t <seconds>    Stop after this long instead\n");
+	printf("  -o <file>       Log stream,seq,len,ns of every message sent\n");
+	printf("  -P              Packet mode, one record per message\n");
+	printf("Without -r, -b or -T messages go out as fast as they can\n");
+	return -1;
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+//When message seq is due, given when the previous one was
+static uint64_t load_due(const struct load_cfg *cfg, uint64_t start,
+		uint64_t prev, uint64_t seq)
+{
+	switch (cfg->shape) {
+	case SHAPE_RATE:
+		return start + (uint64_t)(seq * 1e9 / cfg->rate);
+	case SHAPE_BURST:
+		return seq && !(seq % cfg->burst) ?
+			prev + cfg->gap_us * 1000ULL : prev;
+	case SHAPE_TRACE:
+		return seq ? prev + cfg->trace[(seq - 1) % cfg->trace_nr] *
+			1000ULL : prev;
+	default:
+		return prev;
+	}
+}
+
+static int load_write_window(struct load_window *win, const uint8_t *msg,
+		unsigned int len)
+{
+	pthread_mutex_lock(&win->lock);
+	while (*win->flag_addr & PLAT_IO_DATA_READY)
+		usleep(10);
+	memcpy((void *)win->mem_addr, msg, len);
+	*win->count_addr = len;
+	__sync_synchronize();
+	*win->flag_addr = PLAT_IO_DATA_READY;
+	pthread_mutex_unlock(&win->lock);
+	return 0;
+}
+
+/*
+ * A stream mode write may go in short, the rest of the message then races the
+ * other streams for the ring and lands in the middle of theirs. Streams hold
+ * dev_lock for the whole message, packet mode records go in whole or not at
+ * all and need no lock.
+ */
+static int load_write_dev(int fd, pthread_mutex_t *lock, const uint8_t *msg,
+		unsigned int len)
+{
+	ssize_t ret;
+	int err = 0;
+
+	if (lock)
+		pthread_mutex_lock(lock);
+	while (len) {
+		ret = write(fd, msg, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -1;
+			break;
+		}
+		msg += ret;
+		len -= ret;
+	}
+	if (lock)
+		pthread_mutex_unlock(lock);
+	return err;
+}
+
+static void *load_stream(void *arg)
+{
+	struct load_stream *s = arg;
+	const struct load_cfg *cfg = s->cfg;
+	uint64_t start, due, prev, end, now, seq, ns;
+	uint8_t msg[LOAD_MAX_LEN];
+	int err;
+
+	start = now_ns(CLOCK_MONOTONIC);
+	end = cfg->seconds ? start + cfg->seconds * 1000000000ULL : 0;
+	due = start;
+	for (seq = 0; end || seq < cfg->count; seq++) {
+		prev = due;
+		due = load_due(cfg, start, prev, seq);
+		now = now_ns(CLOCK_MONOTONIC);
+		if (end && (due >= end || now >= end))
+			break;
+		//Back to back messages of a burst are behind by design
+		if (due > now)
+			sleep_until(due);
+		else if (due > prev && now - due > s->max_lag_ns)
+			s->max_lag_ns = now - due;
+
+		ns = now_ns(CLOCK_REALTIME);
+		load_fill(msg, s->id, seq, cfg->size, ns);
+		if (s->win)
+			err = load_write_window(s->win, msg, cfg->size);
+		else
+			err = load_write_dev(s->fd, s->dev_lock, msg,
+					cfg->size);
+		if (err) {
+			s->errors++;
+			continue;
+		}
+		s->sent++;
+		s->bytes += cfg->size;
+		if (cfg->log)
+			fprintf(cfg->log, "%u,%llu,%u,%llu\n", s->id,
+					(unsigned long long)seq, cfg->size,
+					(unsigned long long)ns);
+	}
+	return NULL;
+}
+
+static int load_trace(struct load_cfg *cfg, const char *path)
+{
+	unsigned long gap;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("fopen error (%s)\n", path);
+		return -1;
+	}
+	cfg->trace = malloc(MAX_TRACE * sizeof(*cfg->trace));
+	if (!cfg->trace) {
+		fclose(f);
+		return -1;
+	}
+	while (cfg->trace_nr < MAX_TRACE && fscanf(f, "%lu", &gap) == 1)
+		cfg->trace[cfg->trace_nr++] = gap;
+	fclose(f);
+	if (!cfg->trace_nr) {
+		printf("No gaps in %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int load_map_window(struct load_window *win, int window)
+{
+	volatile unsigned int *reg_addr;
+	int fd;
+
+	fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if (fd < 0) {
+		printf("Can't open /dev/mem\n");
+		return -1;
+	}
+	win->mem_addr = mmap(0, my_devices[window].mem_size, PROT_WRITE,
+			MAP_SHARED, fd, my_devices[window].mem_base);
+	reg_addr = mmap(0, my_devices[window].reg_size,
+			PROT_WRITE | PROT_READ, MAP_SHARED, fd,
+			my_devices[window].reg_base);
+	if (win->mem_addr == MAP_FAILED || reg_addr == MAP_FAILED) {
+		printf("Can't mmap\n");
+		return -1;
+	}
+	win->flag_addr = reg_addr;
+	win->count_addr = reg_addr + 1;
+	pthread_mutex_init(&win->lock, NULL);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct load_stream streams[LOAD_MAX_STREAMS];
+	struct load_cfg cfg = {
+		.window = -1,
+		.streams = 1,
+		.size = 256,
+		.count = 1000,
+	};
+	uint64_t start, sent = 0, bytes = 0, errors = 0, lag = 0;
+	pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct load_window win;
+	unsigned int i;
+	double secs;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:S:s:r:b:T:c:t:o:P")) != -1) {
+		switch (opt) {
+		case 'w': cfg.window = atoi(optarg); break;
+		case 'S': cfg.streams = atoi(optarg); break;
+		case 's': cfg.size = atoi(optarg); break;
+		case 'r':
+			cfg.shape = SHAPE_RATE;
+			cfg.rate = atof(optarg);
+			break;
+		case 'b':
+			cfg.shape = SHAPE_BURST;
+			if (sscanf(optarg, "%u:%u", &cfg.burst,
+						&cfg.gap_us) != 2)
+				return usage(argv);
+			break;
+		case 'T':
+			cfg.shape = SHAPE_TRACE;
+			if (load_trace(&cfg, optarg))
+				return -1;
+			break;
+		case 'c': cfg.count = strtoull(optarg, NULL, 0); break;
+		case 't': cfg.seconds = atoi(optarg); break;
+		case 'o':
+			cfg.log = fopen(optarg, "w");
+			if (!cfg.log) {
+				printf("fopen error (%s)\n", optarg);
+				return -1;
+			}
+			break;
+		case 'P': cfg.packet = 1; break;
+		default: return usage(argv);
+		}
+	}
+	if (cfg.window < 0 && optind != argc - 1)
+		return usage(argv);
+	if (cfg.window >= MAX_DEVICES || !cfg.streams ||
+			cfg.streams > LOAD_MAX_STREAMS ||
+			cfg.size < sizeof(struct load_hdr) ||
+			cfg.size > (cfg.window < 0 && !cfg.packet ?
+				LOAD_MAX_LEN : MEM_SIZE) ||
+			(cfg.shape == SHAPE_RATE && cfg.rate <= 0) ||
+			(cfg.shape == SHAPE_BURST && !cfg.burst))
+		return usage(argv);
+	cfg.dev = cfg.window < 0 ? argv[optind] : "/dev/mem";
+
+	if (cfg.window >= 0 && load_map_window(&win, cfg.window))
+		return -1;
+
+	memset(streams, 0, sizeof(streams));
+	for (i = 0; i < cfg.streams; i++) {
+		streams[i].cfg = &cfg;
+		streams[i].id = i;
+		streams[i].win = cfg.window >= 0 ? &win : NULL;
+		if (streams[i].win)
+			continue;
+		if (!cfg.packet && cfg.streams > 1)
+			streams[i].dev_lock = &dev_lock;
+		streams[i].fd = open(cfg.dev, O_WRONLY | O_APPEND);
+		if (streams[i].fd < 0) {
+			printf("file open error %s\n", cfg.dev);
+			return -1;
+		}
+		//Plain files and pipes are fine too, for trying the verifier
+		if (!i && ioctl(streams[i].fd, DDONE_SET_MODE, cfg.packet ?
+					DDONE_MODE_PACKET : DDONE_MODE_STREAM) &&
+				errno != ENOTTY) {
+			printf("Can't set mode, is the device busy?\n");
+			return -1;
+		}
+	}
+
+	start = now_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < cfg.streams; i++) {
+		if (pthread_create(&streams[i].thread, NULL, load_stream,
+					&streams[i])) {
+			printf("Can't start stream %u\n", i);
+			return -1;
+		}
+	}
+	for (i = 0; i < cfg.streams; i++) {
+		pthread_join(streams[i].thread, NULL);
+		sent += streams[i].sent;
+		bytes += streams[i].bytes;
+		errors += streams[i].errors;
+		if (streams[i].max_lag_ns > lag)
+			lag = streams[i].max_lag_ns;
+	}
+	secs = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+	if (cfg.log)
+		fclose(cfg.log);
+
+	printf("{\"device\":\"%s\",\"window\":%d,\"streams\":%u,\"size\":%u,"
+			"\"msgs\":%llu,\"bytes\":%llu,\"errors\":%llu,"
+			"\"seconds\":%.3f,\"msgs_s\":%.1f,\"mb_s\":%.3f,"
+			"\"max_lag_ns\":%llu}\n",
+			cfg.dev, cfg.window, cfg.streams, cfg.size,
+			(unsigned long long)sent, (unsigned long long)bytes,
+			(unsigned long long)errors, secs, sent / secs,
+			bytes / secs / 1e6, (unsigned long long)lag);
+
+	return errors ? -1 : 0;
+}
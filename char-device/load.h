@@ -0,0 +1,62 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+ * Message format shared by load-data and verify-data. Every message starts
+ * with the header, all fields little endian, and len covers the header too.
+ * Payload byte i of a message is load_byte(stream, seq, i), so the verifier
+ * needs nothing but the capture to spot damage.
+ */
+#define LOAD_MAGIC	0x4c444430 /*"0DDL" in memory */
+#define LOAD_MAX_STREAMS	64
+#define LOAD_MAX_LEN	65535
+
+struct load_hdr {
+	uint32_t magic;
+	uint16_t stream;
+	uint16_t len;
+	uint64_t seq;
+	uint64_t ns; /*CLOCK_REALTIME when it was sent */
+};
+
+static inline uint8_t load_byte(unsigned int stream, uint64_t seq, size_t i)
+{
+	return seq * 31 + stream * 7 + i;
+}
+
+static inline void load_fill(uint8_t *msg, unsigned int stream, uint64_t seq,
+		uint16_t len, uint64_t ns)
+{
+	struct load_hdr hdr = {
+		.magic = htole32(LOAD_MAGIC),
+		.stream = htole16(stream),
+		.len = htole16(len),
+		.seq = htole64(seq),
+		.ns = htole64(ns),
+	};
+	size_t i;
+
+	memcpy(msg, &hdr, sizeof(hdr));
+	for (i = sizeof(hdr); i < len; i++)
+		msg[i] = load_byte(stream, seq, i);
+}
+
+//Returns the first bad payload offset, or len when it is all there
+static inline size_t load_check(const uint8_t *msg, unsigned int stream,
+		uint64_t seq, uint16_t len)
+{
+	size_t i;
+
+	for (i = sizeof(struct load_hdr); i < len; i++) {
+		if (msg[i] != load_byte(stream, seq, i))
+			return i;
+	}
+	return len;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ring.h"
+
+#define MEM_SIZE	1024 /*Largest chunk the driver moves at once */
+#define MAX_SIZES	16
+
+/*
+ * Measures the ring code built for userspace, so a change to ring.c can be
+ * compared on its own. Single threaded runs fill the ring and drain it
+ * again, timing each side; -t runs a producer and a consumer thread.
+ */
+struct bench_cfg {
+	unsigned long iters;
+	int threaded;
+	int check;
+};
+
+struct bench_side {
+	struct ddone_ring *ring;
+	const struct bench_cfg *cfg;
+	size_t size;
+	int bad;
+};
+
+int usage(char **argv)
+{
+	printf("Program measures ring enqueue and dequeue cost\n");
+	printf("Usage: %s [-n <messages>] [-t] [-c] [sizes...]\n", argv[0]);
+	printf("  -n  Messages per size (default 1000000)\n");
+	printf("  -t  Producer and consumer in their own threads\n");
+	printf("  -c  Run the ring_test.c cases, then check the data that comes out\n");
+	printf("Sizes default to 1 8 64 256 %d, at most %d\n", MEM_SIZE,
+			BUF_SIZE);
+	printf("Prints one JSON object per size\n");
+	return -1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_msg(uint8_t *buf, size_t size, unsigned long seq)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = seq + i;
+}
+
+static int check_msg(const uint8_t *buf, size_t size, unsigned long seq)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] != (uint8_t)(seq + i)) {
+			printf("Message %lu byte %zu is %u\n", seq, i, buf[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int enqueue(struct ddone_ring *ring, const uint8_t *buf, size_t size,
+		bool nonblock)
+{
+	size_t count = size;
+	u64 pos;
+	int err;
+
+	err = ring_reserve(ring, size, &count, &pos, nonblock);
+	if (err)
+		return err;
+	ring_copy_in(ring, pos, buf, count);
+	ring_commit(ring, pos, count);
+	return 0;
+}
+
+//Spins like the blocking reserve does, the ring has a single consumer
+static void dequeue(struct ddone_ring *ring, uint8_t *buf, size_t size)
+{
+	while (ring_avail(ring) < size)
+		sched_yield();
+	ring_copy_out(ring, ring->rpos, buf, size);
+	ring_consume(ring, size);
+}
+
+static int bench_single(const struct bench_cfg *cfg, size_t size)
+{
+	static struct ddone_ring ring;
+	uint8_t buf[BUF_SIZE];
+	unsigned long in = 0, out = 0;
+	uint64_t t, enq_ns = 0, deq_ns = 0;
+
+	ring_init(&ring);
+	fill_msg(buf, size, 0);
+	while (out < cfg->iters) {
+		t = now_ns();
+		while (in < cfg->iters) {
+			if (cfg->check)
+				fill_msg(buf, size, in);
+			if (enqueue(&ring, buf, size, true))
+				break;
+			in++;
+		}
+		enq_ns += now_ns() - t;
+
+		t = now_ns();
+		while (out < in) {
+			dequeue(&ring, buf, size);
+			if (cfg->check && check_msg(buf, size, out))
+				return -1;
+			out++;
+		}
+		deq_ns += now_ns() - t;
+	}
+
+	printf("{\"mode\":\"single\",\"buf_size\":%d,\"size\":%zu,"
+			"\"msgs\":%lu,\"enqueue_ns\":%.2f,\"dequeue_ns\":%.2f,"
+			"\"mb_s\":%.1f}\n",
+			BUF_SIZE, size, cfg->iters,
+			(double)enq_ns / cfg->iters, (double)deq_ns / cfg->iters,
+			(double)size * cfg->iters * 1e3 / (enq_ns + deq_ns));
+	return 0;
+}
+
+static void *producer(void *arg)
+{
+	struct bench_side *side = arg;
+	uint8_t buf[BUF_SIZE];
+	unsigned long seq;
+
+	fill_msg(buf, side->size, 0);
+	for (seq = 0; seq < side->cfg->iters; seq++) {
+		if (side->cfg->check)
+			fill_msg(buf, side->size, seq);
+		enqueue(side->ring, buf, side->size, false);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct bench_side *side = arg;
+	uint8_t buf[BUF_SIZE];
+	unsigned long seq;
+
+	for (seq = 0; seq < side->cfg->iters; seq++) {
+		dequeue(side->ring, buf, side->size);
+		if (side->cfg->check && check_msg(buf, side->size, seq)) {
+			side->bad = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int bench_threaded(const struct bench_cfg *cfg, size_t size)
+{
+	static struct ddone_ring ring;
+	struct bench_side side = {
+		.ring = &ring,
+		.cfg = cfg,
+		.size = size,
+	};
+	pthread_t prod, cons;
+	uint64_t t;
+
+	ring_init(&ring);
+	t = now_ns();
+	if (pthread_create(&cons, NULL, consumer, &side))
+		return -1;
+	//Leaving main takes a thread that is still waiting along
+	if (pthread_create(&prod, NULL, producer, &side))
+		return -1;
+	pthread_join(cons, NULL);
+	if (side.bad)
+		return -1;
+	pthread_join(prod, NULL);
+	t = now_ns() - t;
+
+	printf("{\"mode\":\"threaded\",\"buf_size\":%d,\"size\":%zu,"
+			"\"msgs\":%lu,\"msg_ns\":%.2f,\"mb_s\":%.1f}\n",
+			BUF_SIZE, size, cfg->iters, (double)t / cfg->iters,
+			(double)size * cfg->iters * 1e3 / t);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t sizes[MAX_SIZES] = { 1, 8, 64, 256, MEM_SIZE };
+	struct bench_cfg cfg = {
+		.iters = 1000000,
+	};
+	unsigned int i, nr = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:tc")) != -1) {
+		switch (opt) {
+		case 'n': cfg.iters = strtoul(optarg, NULL, 0); break;
+		case 't': cfg.threaded = 1; break;
+		case 'c': cfg.check = 1; break;
+		default: return usage(argv);
+		}
+	}
+	if (!cfg.iters || argc - optind > MAX_SIZES)
+		return usage(argv);
+	if (optind < argc) {
+		nr = argc - optind;
+		for (i = 0; i < nr; i++) {
+			sizes[i] = strtoul(argv[optind + i], NULL, 0);
+			if (!sizes[i] || sizes[i] > BUF_SIZE)
+				return usage(argv);
+		}
+	}
+
+	if (cfg.check && ring_test_run())
+		return -1;
+	for (i = 0; i < nr; i++) {
+		if (cfg.threaded ? bench_threaded(&cfg, sizes[i]) :
+				bench_single(&cfg, sizes[i]))
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+#include "ring.h"
+
+void ring_init(struct ddone_ring *ring)
+{
+	BUILD_BUG_ON(!is_power_of_2(BUF_SIZE));
+
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->rq);
+	init_waitqueue_head(&ring->wq);
+	init_waitqueue_head(&ring->cq);
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_init);
+
+size_t ring_space(struct ddone_ring *ring)
+{
+	size_t space;
+
+	spin_lock(&ring->lock);
+	space = BUF_SIZE - (ring->head - ring->rpos);
+	spin_unlock(&ring->lock);
+
+	return space;
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_space);
+
+size_t ring_avail(struct ddone_ring *ring)
+{
+	size_t avail;
+
+	spin_lock(&ring->lock);
+	avail = ring->tail - ring->rpos;
+	spin_unlock(&ring->lock);
+
+	return avail;
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_avail);
+
+bool ring_committed(struct ddone_ring *ring, u64 pos)
+{
+	bool ret;
+
+	spin_lock(&ring->lock);
+	ret = ring->tail == pos;
+	spin_unlock(&ring->lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_committed);
+
+/*
+ * Reserves at least min and at most *count bytes for a producer. The space
+ * may wrap, it belongs to the caller until ring_commit() and is filled
+ * without holding any lock.
+ */
+int ring_reserve(struct ddone_ring *ring, size_t min, size_t *count,
+		u64 *pos, bool nonblock)
+{
+	size_t space;
+	int err;
+
+	if (min > BUF_SIZE)
+		return -EMSGSIZE;
+
+	for (;;) {
+		spin_lock(&ring->lock);
+		space = BUF_SIZE - (ring->head - ring->rpos);
+		if (space >= min && space) {
+			*count = min(*count, space);
+			*pos = ring->head;
+			ring->head += *count;
+			spin_unlock(&ring->lock);
+			return 0;
+		}
+		spin_unlock(&ring->lock);
+
+		if (nonblock)
+			return -EAGAIN;
+		err = wait_event_interruptible(ring->wq,
+				ring_space(ring) >= max_t(size_t, min, 1));
+		if (err)
+			return err;
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_reserve);
+
+/*
+ * Like ring_reserve() without blocking, but only while no other
+ * reservation is in flight, so the ring_commit() of this one never waits.
+ */
+int ring_try_reserve(struct ddone_ring *ring, size_t min, size_t *count,
+		u64 *pos)
+{
+	size_t space;
+
+	if (min > BUF_SIZE)
+		return -EMSGSIZE;
+
+	spin_lock(&ring->lock);
+	space = BUF_SIZE - (ring->head - ring->rpos);
+	if (ring->head != ring->tail || space < min || !space) {
+		spin_unlock(&ring->lock);
+		return -EAGAIN;
+	}
+	*count = min(*count, space);
+	*pos = ring->head;
+	ring->head += *count;
+	spin_unlock(&ring->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_try_reserve);
+
+//Publishes a reservation once all earlier ones are published
+void ring_commit(struct ddone_ring *ring, u64 pos, size_t count)
+{
+	wait_event(ring->cq, ring_committed(ring, pos));
+
+	spin_lock(&ring->lock);
+	ring->tail = pos + count;
+	spin_unlock(&ring->lock);
+
+	wake_up_all(&ring->cq);
+	wake_up_interruptible(&ring->rq);//Notify consumers
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_commit);
+
+//Called by the single consumer only, frees the oldest count bytes
+void ring_consume(struct ddone_ring *ring, size_t count)
+{
+	spin_lock(&ring->lock);
+	ring->rpos += count;
+	spin_unlock(&ring->lock);
+
+	wake_up_interruptible(&ring->wq);//Notify producers
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_consume);
+
+void ring_copy_in(struct ddone_ring *ring, u64 pos, const void *src,
+		size_t count)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+
+	memcpy(ring->data + off, src, first);
+	memcpy(ring->data, src + first, count - first);
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_copy_in);
+
+void ring_copy_out(struct ddone_ring *ring, u64 pos, void *dst,
+		size_t count)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+
+	memcpy(dst, ring->data + off, first);
+	memcpy(dst + first, ring->data, count - first);
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_copy_out);
+
+void ring_fill(struct ddone_ring *ring, u64 pos, int c, size_t count)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+
+	memset(ring->data + off, c, first);
+	memset(ring->data, c, count - first);
+}
+EXPORT_SYMBOL_IF_KUNIT(ring_fill);
+
+#ifdef __KERNEL__
+size_t ring_copy_from_iter(struct ddone_ring *ring, u64 pos,
+		size_t count, struct iov_iter *from)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+	size_t copied;
+
+	copied = copy_from_iter(ring->data + off, first, from);
+	if (copied == first && count > first)
+		copied += copy_from_iter(ring->data, count - first, from);
+
+	return copied;
+}
+
+size_t ring_copy_to_iter(struct ddone_ring *ring, u64 pos,
+		size_t count, struct iov_iter *to)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+	size_t copied;
+
+	copied = copy_to_iter(ring->data + off, first, to);
+	if (copied == first && count > first)
+		copied += copy_to_iter(ring->data, count - first, to);
+
+	return copied;
+}
+
+void ring_copy_from_io(struct ddone_ring *ring, u64 pos,
+		const void __iomem *src, size_t count)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+
+	memcpy_fromio(ring->data + off, src, first);
+	memcpy_fromio(ring->data, src + first, count - first);
+}
+
+void ring_copy_to_io(struct ddone_ring *ring, u64 pos,
+		void __iomem *dst, size_t count)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+
+	memcpy_toio(dst, ring->data + off, first);
+	memcpy_toio(dst + first, ring->data, count - first);
+}
+
+//Run right after a copy to or from the window, while the span is cache hot
+u32 ring_crc32c(struct ddone_ring *ring, u64 pos, size_t count,
+		u32 crc)
+{
+	size_t off = pos & (BUF_SIZE - 1);
+	size_t first = min_t(size_t, count, BUF_SIZE - off);
+
+	crc = crc32c(crc, ring->data + off, first);
+	return crc32c(crc, ring->data, count - first);
+}
+#endif
@@ -0,0 +1,101 @@
+#ifndef RING_H
+#define RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/build_bug.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/io.h>
+#include <linux/crc32c.h>
+#include <kunit/visibility.h>
+
+#include "device.h"
+#else
+/*
+ * Userspace build for ring-bench: a spinlock is a pthread spinlock and
+ * waiting spins on sched_yield(), there is nobody to wake.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifndef BUF_SIZE
+#define BUF_SIZE 2048 //Same as device.h, -DBUF_SIZE= to try others
+#endif
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef pthread_spinlock_t spinlock_t;
+typedef int wait_queue_head_t;
+
+#define spin_lock_init(lock) pthread_spin_init(lock, PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(lock) pthread_spin_lock(lock)
+#define spin_unlock(lock) pthread_spin_unlock(lock)
+#define init_waitqueue_head(wq) (*(wq) = 0)
+#define wait_event(wq, cond) do { while (!(cond)) sched_yield(); } while (0)
+#define wait_event_interruptible(wq, cond) ({ wait_event(wq, cond); 0; })
+#define wake_up_all(wq) do { } while (0)
+#define wake_up_interruptible(wq) do { } while (0)
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define is_power_of_2(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+typedef uint8_t u8;
+
+#define EXPORT_SYMBOL_IF_KUNIT(sym)
+
+int ring_test_run(void);//ring_test.c cases, returns how many failed
+#endif
+
+/*
+ * Free running stream offsets: producers reserve [head, ...) and commit in
+ * reservation order to tail, the single consumer frees up to rpos.
+ */
+struct ddone_ring {
+	spinlock_t lock;
+	u64 head, tail, rpos;
+	wait_queue_head_t rq, wq, cq;//Data, space and commit order queues
+	char data[BUF_SIZE];
+};
+
+void   ring_init(struct ddone_ring *ring);
+size_t ring_space(struct ddone_ring *ring);
+size_t ring_avail(struct ddone_ring *ring);
+bool   ring_committed(struct ddone_ring *ring, u64 pos);
+int    ring_reserve(struct ddone_ring *ring, size_t min, size_t *count,
+		u64 *pos, bool nonblock);
+int    ring_try_reserve(struct ddone_ring *ring, size_t min, size_t *count,
+		u64 *pos);
+void   ring_commit(struct ddone_ring *ring, u64 pos, size_t count);
+void   ring_consume(struct ddone_ring *ring, size_t count);
+void   ring_copy_in(struct ddone_ring *ring, u64 pos, const void *src,
+		size_t count);
+void   ring_copy_out(struct ddone_ring *ring, u64 pos, void *dst,
+		size_t count);
+void   ring_fill(struct ddone_ring *ring, u64 pos, int c, size_t count);
+
+#ifdef __KERNEL__
+size_t ring_copy_from_iter(struct ddone_ring *ring, u64 pos,
+		size_t count, struct iov_iter *from);
+size_t ring_copy_to_iter(struct ddone_ring *ring, u64 pos,
+		size_t count, struct iov_iter *to);
+void   ring_copy_from_io(struct ddone_ring *ring, u64 pos,
+		const void __iomem *src, size_t count);
+void   ring_copy_to_io(struct ddone_ring *ring, u64 pos,
+		void __iomem *dst, size_t count);
+u32    ring_crc32c(struct ddone_ring *ring, u64 pos, size_t count,
+		u32 crc);
+#endif
+
+#endif
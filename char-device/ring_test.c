@@ -0,0 +1,280 @@
+#ifdef __KERNEL__
+#include <kunit/test.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+#include "ring.h"
+
+/*
+ * Ring properties at every wrap offset, with a full and an empty ring. With
+ * CONFIG_KUNIT they build into their own ring_test module, which runs them
+ * against chardev's ring.c when loaded. ring-bench -c runs the same cases
+ * against the userspace build of ring.c through the small KUnit stand-in
+ * below.
+ */
+#ifndef __KERNEL__
+struct kunit {
+	const char *name;
+	int failures;
+	void *mem;
+};
+
+struct kunit_case {
+	void (*run_case)(struct kunit *test);
+	const char *name;
+};
+
+struct kunit_suite {
+	const char *name;
+	struct kunit_case *test_cases;
+};
+
+#define KUNIT_CASE(f) { .run_case = f, .name = #f }
+#define kunit_test_suite(suite)
+
+#define KUNIT_EXPECT_EQ(test, left, right) do {				\
+	long long _l = (left), _r = (right);				\
+	if (_l != _r) {							\
+		printf("%s:%d: %s is %lld, expected %lld\n",		\
+				(test)->name, __LINE__, #left, _l, _r);	\
+		(test)->failures++;					\
+	}								\
+} while (0)
+
+#define KUNIT_ASSERT_EQ(test, left, right) do {				\
+	int _f = (test)->failures;					\
+	KUNIT_EXPECT_EQ(test, left, right);				\
+	if ((test)->failures != _f)					\
+		return;							\
+} while (0)
+
+#define KUNIT_ASSERT_NOT_NULL(test, ptr) \
+	KUNIT_ASSERT_EQ(test, (ptr) != NULL, 1)
+
+//One allocation per case is all the cases need, freed after it ran
+static void *kunit_kzalloc(struct kunit *test, size_t size, int gfp)
+{
+	test->mem = calloc(1, size);
+	return test->mem;
+}
+#define GFP_KERNEL 0
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+struct ring_test_ctx {
+	struct ddone_ring ring;
+	u8 src[BUF_SIZE], dst[BUF_SIZE];
+};
+
+static struct ring_test_ctx *ring_test_ctx(struct kunit *test, u64 start)
+{
+	struct ring_test_ctx *ctx;
+	size_t i;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return NULL;
+	ring_init(&ctx->ring);
+	//Offsets are free running, start anywhere
+	ctx->ring.head = ctx->ring.tail = ctx->ring.rpos = start;
+	for (i = 0; i < BUF_SIZE; i++)
+		ctx->src[i] = i * 7 + 3;
+	return ctx;
+}
+
+static void ring_test_empty(struct kunit *test)
+{
+	struct ring_test_ctx *ctx = ring_test_ctx(test, 0);
+	size_t count;
+	u64 pos;
+
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), BUF_SIZE);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), 0);
+	KUNIT_EXPECT_EQ(test, ring_committed(&ctx->ring, 0), true);
+
+	count = BUF_SIZE + 1;
+	KUNIT_EXPECT_EQ(test, ring_reserve(&ctx->ring, BUF_SIZE + 1, &count,
+			&pos, true), -EMSGSIZE);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), BUF_SIZE);
+
+	//Asking for more than there is hands out what there is
+	count = BUF_SIZE * 2;
+	KUNIT_ASSERT_EQ(test, ring_reserve(&ctx->ring, 1, &count, &pos,
+			true), 0);
+	KUNIT_EXPECT_EQ(test, count, BUF_SIZE);
+	KUNIT_EXPECT_EQ(test, pos, 0);
+	//Reserved but not committed is neither space nor data
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), 0);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), 0);
+}
+
+static void ring_test_full(struct kunit *test)
+{
+	struct ring_test_ctx *ctx = ring_test_ctx(test, 0);
+	size_t count;
+	u64 pos;
+
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	count = BUF_SIZE;
+	KUNIT_ASSERT_EQ(test, ring_reserve(&ctx->ring, BUF_SIZE, &count, &pos,
+			true), 0);
+	ring_commit(&ctx->ring, pos, count);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), 0);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), BUF_SIZE);
+
+	count = 1;
+	KUNIT_EXPECT_EQ(test, ring_reserve(&ctx->ring, 1, &count, &pos, true),
+			-EAGAIN);
+	count = 1;
+	KUNIT_EXPECT_EQ(test, ring_reserve(&ctx->ring, 0, &count, &pos, true),
+			-EAGAIN);
+
+	//Freeing a little lets exactly that much in, a bigger min still waits
+	ring_consume(&ctx->ring, 3);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), 3);
+	count = 4;
+	KUNIT_EXPECT_EQ(test, ring_reserve(&ctx->ring, 4, &count, &pos, true),
+			-EAGAIN);
+	count = BUF_SIZE;
+	KUNIT_ASSERT_EQ(test, ring_reserve(&ctx->ring, 1, &count, &pos, true),
+			0);
+	KUNIT_EXPECT_EQ(test, count, 3);
+	KUNIT_EXPECT_EQ(test, pos, BUF_SIZE);
+	ring_commit(&ctx->ring, pos, count);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), 0);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), BUF_SIZE);
+}
+
+//Commits publish in reservation order, tail follows them one by one
+static void ring_test_commit(struct kunit *test)
+{
+	struct ring_test_ctx *ctx = ring_test_ctx(test, 0);
+	size_t a = 100, b = 200, c = 1;
+	u64 pa, pb, pc;
+
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	KUNIT_ASSERT_EQ(test, ring_reserve(&ctx->ring, a, &a, &pa, true), 0);
+	KUNIT_ASSERT_EQ(test, ring_reserve(&ctx->ring, b, &b, &pb, true), 0);
+	KUNIT_EXPECT_EQ(test, pb, pa + a);
+	KUNIT_EXPECT_EQ(test, ring_committed(&ctx->ring, pb), false);
+
+	//A reservation in flight keeps ring_try_reserve() out
+	KUNIT_EXPECT_EQ(test, ring_try_reserve(&ctx->ring, 1, &c, &pc),
+			-EAGAIN);
+
+	ring_commit(&ctx->ring, pa, a);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), a);
+	KUNIT_EXPECT_EQ(test, ring_committed(&ctx->ring, pb), true);
+	ring_commit(&ctx->ring, pb, b);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), a + b);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), BUF_SIZE - a - b);
+
+	ring_consume(&ctx->ring, a + b);
+	KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), 0);
+	KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring), BUF_SIZE);
+
+	//With none in flight its commit is next in line right away
+	c = BUF_SIZE * 2;
+	KUNIT_ASSERT_EQ(test, ring_try_reserve(&ctx->ring, 1, &c, &pc), 0);
+	KUNIT_EXPECT_EQ(test, c, BUF_SIZE);
+	KUNIT_EXPECT_EQ(test, ring_committed(&ctx->ring, pc), true);
+	KUNIT_EXPECT_EQ(test, ring_try_reserve(&ctx->ring, 0, &c, &pc),
+			-EAGAIN);
+}
+
+/*
+ * Short, odd, over half and full ring spans at every start offset, so each
+ * possible split of a copy is taken. Starts just below 2^32 to show the
+ * offsets do not wrap with 32 bits.
+ */
+static void ring_test_wrap(struct kunit *test)
+{
+	static const size_t sizes[] = { 1, 5, BUF_SIZE / 2 + 1, BUF_SIZE };
+	struct ring_test_ctx *ctx;
+	u64 start, base = 0x100000000ULL - BUF_SIZE / 2;
+	size_t off, i, count, bad;
+	u64 pos;
+
+	ctx = ring_test_ctx(test, base);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	for (off = 0; off < BUF_SIZE; off++) {
+		for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+			start = base + off;
+			ctx->ring.head = ctx->ring.tail = start;
+			ctx->ring.rpos = start;
+
+			count = sizes[i];
+			KUNIT_ASSERT_EQ(test, ring_reserve(&ctx->ring, count,
+					&count, &pos, true), 0);
+			KUNIT_ASSERT_EQ(test, pos, start);
+			ring_copy_in(&ctx->ring, pos, ctx->src, count);
+			ring_commit(&ctx->ring, pos, count);
+			//Ends land where the offsets say, not just symmetric
+			KUNIT_ASSERT_EQ(test,
+					(u8)ctx->ring.data[start & (BUF_SIZE - 1)],
+					ctx->src[0]);
+			KUNIT_ASSERT_EQ(test, (u8)ctx->ring.data[(start + count -
+					1) & (BUF_SIZE - 1)], ctx->src[count - 1]);
+			KUNIT_EXPECT_EQ(test, ring_avail(&ctx->ring), count);
+
+			memset(ctx->dst, 0, BUF_SIZE);
+			ring_copy_out(&ctx->ring, pos, ctx->dst, count);
+			bad = memcmp(ctx->src, ctx->dst, count);
+			KUNIT_ASSERT_EQ(test, bad, 0);
+
+			ring_fill(&ctx->ring, pos, 0xa5, count);
+			ring_copy_out(&ctx->ring, pos, ctx->dst, count);
+			KUNIT_ASSERT_EQ(test, ctx->dst[0], 0xa5);
+			KUNIT_ASSERT_EQ(test, ctx->dst[count - 1], 0xa5);
+
+			ring_consume(&ctx->ring, count);
+			KUNIT_EXPECT_EQ(test, ring_space(&ctx->ring),
+					BUF_SIZE);
+		}
+	}
+}
+
+static struct kunit_case ring_test_cases[] = {
+	KUNIT_CASE(ring_test_empty),
+	KUNIT_CASE(ring_test_full),
+	KUNIT_CASE(ring_test_commit),
+	KUNIT_CASE(ring_test_wrap),
+	{}
+};
+
+static struct kunit_suite ring_test_suite = {
+	.name = "ddone_ring",
+	.test_cases = ring_test_cases,
+};
+kunit_test_suite(ring_test_suite);
+
+#ifdef __KERNEL__
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+MODULE_DESCRIPTION("ddone ring KUnit cases");
+MODULE_LICENSE("Dual BSD/GPL");
+#endif
+
+#ifndef __KERNEL__
+int ring_test_run(void)
+{
+	struct kunit_case *c;
+	struct kunit test;
+	int failed = 0;
+
+	for (c = ring_test_suite.test_cases; c->run_case; c++) {
+		test = (struct kunit){ .name = c->name };
+		c->run_case(&test);
+		free(test.mem);
+		printf("%s %s.%s\n", test.failures ? "not ok" : "ok",
+				ring_test_suite.name, c->name);
+		failed += !!test.failures;
+	}
+	return failed;
+}
+#endif
@@ -3,11 +3,16 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <lz4.h>
+#include <endian.h>
 
 
 
@@ -23,16 +28,23 @@
 #define PLAT_IO_FLAG_REG		(0) /*Offset of flag register*/
 #define PLAT_IO_SIZE_REG		(4) /*Offset of flag register*/
 #define PLAT_IO_DATA_READY	(1) /*IO data ready flag */
+#define PLAT_IO_LZ4		(2) /*Chunk is an LZ4 block */
+#define PLAT_IO_SEQ		(8) /*Striped chunk, starts with LE u32 sequence */
+#define SEQ_SIZE		4
 
-#define MAX_DEVICES	2
+#define MAX_RAW		2048 /*Driver inflates a chunk into its ring size */
+#define BLOCK_SIZE	(1 << 20) /*Most one read() of the file takes */
+#define SPINS		2000 /*Flag reads before the first sleep */
+#define MIN_SLEEP_US	10
+#define MAX_SLEEP_US	50000
 
-extern int errno;
+#define MAX_DEVICES	2
 
 struct my_device {
 	uint32_t mem_base;
 	uint32_t mem_size;
 	uint32_t reg_base;
-	uint32_t reg_size;	
+	uint32_t reg_size;
 };
 
 static struct my_device my_devices[MAX_DEVICES] = {{
@@ -48,52 +60,307 @@ static struct my_device my_devices[MAX_DEVICES] = {{
 	.reg_size = REG_SIZE,
 	},
 };
+
+/*
+ * Double buffer between the reader thread and the window loop. Each block
+ * holds what one read() returned, the reader fills one while the other is
+ * being sent. Memory stays at two blocks, and from a pipe the first chunk
+ * goes out as soon as the producer wrote anything.
+ */
+struct stream {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	uint8_t *buf[2];
+	size_t len[2];
+	int full[2];
+	int err;
+	unsigned int cur; /*Block the window loop is on */
+	size_t off;
+	size_t avail; /*Length of cur once the loop has it */
+	int have;
+	int eof;
+	uint64_t total; /*File size if known, for progress */
+	uint64_t sent;
+	uint64_t start_ns;
+	uint64_t first_ns;
+	uint64_t report_ns;
+};
+
 int usage(char **argv)
 {
 	printf("Program sends file to the specific device\n");
-	printf("Usage: %s <device> <file>\n", argv[0]);
+	printf("Usage: %s [-z [-P]] [-q] <device> <file>\n", argv[0]);
+	printf("       %s [-q] -a <windows> <file>\n", argv[0]);
+	printf("  -z  LZ4 compress chunks that get smaller\n");
+	printf("  -P  Driver is in packet mode, chunks inflate to %d bytes at most\n",
+			MEM_SIZE);
+	printf("  -a  Stripe over the first <windows> devices for the aggregate,\n");
+	printf("      which is minor %d of the ddone_device major\n",
+			MAX_DEVICES);
+	printf("  -q  No progress lines\n");
+	printf("<file> can be - for stdin\n");
 	return -1;
 }
 
-int main(int argc, char **argv)
+static uint64_t now_ns(void)
 {
-	volatile unsigned int *reg_addr = NULL, *count_addr, *flag_addr;
-	volatile unsigned char *mem_addr = NULL;
-	unsigned int i, device, ret, len, count;
-	struct stat st;
-	uint8_t *buf;
-	FILE *f;
+	struct timespec ts;
 
-	if (argc != 3) {
-		return usage(argv);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *stream_reader(void *arg)
+{
+	struct stream *s = arg;
+	unsigned int i = 0;
+	ssize_t ret;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->full[i])
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+
+		do {
+			ret = read(s->fd, s->buf[i], BLOCK_SIZE);
+		} while (ret < 0 && errno == EINTR);
+
+		pthread_mutex_lock(&s->lock);
+		s->len[i] = ret > 0 ? ret : 0;
+		s->full[i] = 1;
+		s->err = ret < 0;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		//An empty block is the last one
+		if (ret <= 0)
+			return NULL;
+		i ^= 1;
 	}
+}
 
-	device = atoi(argv[1]);
-	if (device >= MAX_DEVICES)
-		return usage(argv);
+/*
+ * Copies up to count bytes of the file to dst. It only waits for the reader
+ * while it has nothing, so a slow producer gets short chunks instead of a
+ * late one. Returns 0 once the file is done.
+ */
+static size_t stream_get(struct stream *s, void *dst, size_t count)
+{
+	size_t done = 0, n;
+
+	while (done < count && !s->eof) {
+		if (s->off == s->avail) {
+			pthread_mutex_lock(&s->lock);
+			if (s->have) {
+				s->full[s->cur] = 0;
+				pthread_cond_broadcast(&s->cond);
+				s->cur ^= 1;
+				s->off = 0;
+				s->avail = 0;
+				s->have = 0;
+			}
+			if (done && !s->full[s->cur]) {
+				pthread_mutex_unlock(&s->lock);
+				break;
+			}
+			while (!s->full[s->cur])
+				pthread_cond_wait(&s->cond, &s->lock);
+			s->avail = s->len[s->cur];
+			pthread_mutex_unlock(&s->lock);
+			s->have = 1;
+			s->eof = !s->avail;
+			continue;
+		}
+		n = s->avail - s->off;
+		n = n < count - done ? n : count - done;
+		memcpy((uint8_t *)dst + done, s->buf[s->cur] + s->off, n);
+		s->off += n;
+		done += n;
+	}
+	return done;
+}
 
-	ret = stat(argv[2], &st);
-	if (ret) {
-		printf("ERROR: Can't find (%s)\n", argv[2]);
+static int stream_open(struct stream *s, const char *path)
+{
+	struct stat st;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = strcmp(path, "-") ? open(path, O_RDONLY) : 0;
+	if (s->fd < 0) {
+		printf("ERROR: Can't open (%s)\n", path);
 		return -1;
 	}
-	buf = (uint8_t *) malloc(st.st_size);
-	if (!buf) {
+	if (!fstat(s->fd, &st) && S_ISREG(st.st_mode))
+		s->total = st.st_size;
+	posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	s->buf[0] = malloc(BLOCK_SIZE);
+	s->buf[1] = malloc(BLOCK_SIZE);
+	if (!s->buf[0] || !s->buf[1]) {
 		printf("ERROR: Out of memory");
 		return -1;
 	}
-
-	f = fopen(argv[2], "rb");
-	if (!f) {
-		printf("fopen error (%s)\n", argv[2]);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->start_ns = now_ns();
+	s->report_ns = s->start_ns;
+	if (pthread_create(&s->thread, NULL, stream_reader, s)) {
+		printf("Can't start reader\n");
 		return -1;
 	}
-	len = fread(buf, 1U, st.st_size, f);
-	fclose(f);
-	if (len != st.st_size) {
-		printf("File read Error (%s)\n", argv[2]);
+	return 0;
+}
+
+static void stream_progress(struct stream *s, size_t bytes, int quiet)
+{
+	uint64_t now = now_ns();
+
+	if (!s->first_ns)
+		s->first_ns = now;
+	s->sent += bytes;
+	if (quiet || now - s->report_ns < 1000000000ULL)
+		return;
+	s->report_ns = now;
+	if (s->total)
+		fprintf(stderr, "\r%llu/%llu MiB %.1f MB/s",
+				(unsigned long long)(s->sent >> 20),
+				(unsigned long long)(s->total >> 20),
+				s->sent / ((now - s->start_ns) / 1e9) / 1e6);
+	else
+		fprintf(stderr, "\r%llu MiB %.1f MB/s",
+				(unsigned long long)(s->sent >> 20),
+				s->sent / ((now - s->start_ns) / 1e9) / 1e6);
+}
+
+static int stream_close(struct stream *s, int quiet)
+{
+	double secs = (now_ns() - s->start_ns) / 1e9;
+
+	pthread_join(s->thread, NULL);
+	if (s->err) {
+		printf("File read Error\n");
 		return -1;
 	}
+	if (!quiet)
+		fprintf(stderr, "\r%llu bytes in %.3f s, %.1f MB/s, "
+				"first chunk after %.3f ms\n",
+				(unsigned long long)s->sent, secs,
+				s->sent / secs / 1e6, s->first_ns ?
+				(s->first_ns - s->start_ns) / 1e6 : 0);
+	return 0;
+}
+
+/*
+ * Spin first, the driver usually takes a chunk within microseconds. If it
+ * does not, back off to sleeps of up to MAX_SLEEP_US.
+ */
+static void wait_idle(unsigned int *idle)
+{
+	unsigned int us;
+
+	if (++*idle < SPINS)
+		return;
+	us = MIN_SLEEP_US << ((*idle - SPINS) < 12 ? (*idle - SPINS) : 12);
+	usleep(us < MAX_SLEEP_US ? us : MAX_SLEEP_US);
+}
+
+static void wait_free(volatile unsigned int *flag_addr)
+{
+	unsigned int idle = 0;
+
+	while (*flag_addr & PLAT_IO_DATA_READY)
+		wait_idle(&idle);
+}
+
+/*
+ * Every window that is free takes the next sequence numbered chunk, the
+ * driver puts them back in order. The stream ends with an empty chunk on
+ * window 0 once all of them were taken.
+ */
+int send_striped(int fd, unsigned int windows, struct stream *s, int quiet)
+{
+	volatile unsigned int *flag_addr[MAX_DEVICES], *count_addr[MAX_DEVICES];
+	volatile unsigned char *mem_addr[MAX_DEVICES];
+	unsigned int i, count, busy, idle = 0, done = 0;
+	uint8_t buf[MEM_SIZE];
+	uint32_t seq = 0, le;
+
+	for (i = 0; i < windows; i++) {
+		mem_addr[i] = mmap(0, my_devices[i].mem_size, PROT_WRITE,
+				MAP_SHARED, fd, my_devices[i].mem_base);
+		flag_addr[i] = mmap(0, my_devices[i].reg_size,
+				PROT_WRITE | PROT_READ, MAP_SHARED, fd,
+				my_devices[i].reg_base);
+		if (mem_addr[i] == MAP_FAILED || flag_addr[i] == MAP_FAILED) {
+			printf("Can't mmap\n");
+			return -1;
+		}
+		count_addr[i] = flag_addr[i] + 1;
+		*flag_addr[i] = 0;
+	}
+
+	do {
+		busy = 0;
+		for (i = 0; i < windows; i++) {
+			if (*flag_addr[i] & PLAT_IO_DATA_READY) {
+				busy++;
+				continue;
+			}
+			if (done)
+				continue;
+			count = stream_get(s, buf,
+					my_devices[i].mem_size - SEQ_SIZE);
+			if (!count) {
+				done = 1;
+				continue;
+			}
+			le = htole32(seq++);
+			memcpy((void *)mem_addr[i], &le, SEQ_SIZE);
+			memcpy((void *)(mem_addr[i] + SEQ_SIZE), buf, count);
+			*count_addr[i] = SEQ_SIZE + count;
+			*flag_addr[i] = PLAT_IO_DATA_READY | PLAT_IO_SEQ;
+			stream_progress(s, count, quiet);
+			busy++;
+			idle = 0;
+		}
+		if (busy)
+			wait_idle(&idle);
+	} while (!done || busy);
+
+	*count_addr[0] = 0;
+	*flag_addr[0] = PLAT_IO_DATA_READY;
+
+	return stream_close(s, quiet);
+}
+
+int main(int argc, char **argv)
+{
+	volatile unsigned int *reg_addr = NULL, *count_addr, *flag_addr;
+	volatile unsigned char *mem_addr = NULL;
+	unsigned int device, count, lz4 = 0, striped = 0, quiet = 0;
+	unsigned int max_raw = MAX_RAW;
+	char raw[MAX_RAW], zbuf[MEM_SIZE];
+	int src_len, zlen, raw_len = 0, opt;
+	struct stream s;
+
+	while ((opt = getopt(argc, argv, "zPaq")) != -1) {
+		switch (opt) {
+		case 'z': lz4 = 1; break;
+		//A record never inflates past what fits a window
+		case 'P': max_raw = MEM_SIZE; break;
+		case 'a': striped = 1; break;
+		case 'q': quiet = 1; break;
+		default: return usage(argv);
+		}
+	}
+	if (optind != argc - 2 || (lz4 && striped))
+		return usage(argv);
+
+	device = atoi(argv[optind]);
+	if (striped ? !device || device > MAX_DEVICES : device >= MAX_DEVICES)
+		return usage(argv);
 
 	int fd = open("/dev/mem",O_RDWR|O_SYNC);
 	if(fd < 0)
@@ -101,9 +368,14 @@ int main(int argc, char **argv)
 		printf("Can't open /dev/mem\n");
 		return -1;
 	}
+	if (stream_open(&s, argv[optind + 1]))
+		return -1;
+	if (striped)
+		return send_striped(fd, device, &s, quiet);
+
 	mem_addr = (unsigned char *) mmap(0, my_devices[device].mem_size,
 				PROT_WRITE, MAP_SHARED, fd, my_devices[device].mem_base);
-	if(mem_addr == NULL)
+	if(mem_addr == MAP_FAILED)
 	{
 		printf("Can't mmap\n");
 		return -1;
@@ -117,19 +389,42 @@ int main(int argc, char **argv)
 	count_addr++;
 
 	*flag_addr = 0;
-	while (len) {
-		while (*flag_addr & PLAT_IO_DATA_READY) {
-			usleep(50000);
+	for (;;) {
+		if (lz4) {
+			//Whatever LZ4 did not take stays at the front of raw
+			raw_len += stream_get(&s, raw + raw_len,
+					max_raw - raw_len);
+			if (!raw_len)
+				break;
+			src_len = raw_len;
+			zlen = LZ4_compress_destSize(raw, zbuf, &src_len,
+					my_devices[device].mem_size);
+			wait_free(flag_addr);
+			if (zlen > 0 && zlen < src_len) {
+				memcpy((void *)mem_addr, zbuf, zlen);
+				*count_addr = zlen;
+				*flag_addr = PLAT_IO_DATA_READY | PLAT_IO_LZ4;
+			} else {
+				src_len = raw_len < my_devices[device].mem_size ?
+					raw_len : my_devices[device].mem_size;
+				memcpy((void *)mem_addr, raw, src_len);
+				*count_addr = src_len;
+				*flag_addr = PLAT_IO_DATA_READY;
+			}
+			memmove(raw, raw + src_len, raw_len - src_len);
+			raw_len -= src_len;
+			stream_progress(&s, src_len, quiet);
+			continue;
 		}
-		count = len > my_devices[device].mem_size ? 
-				my_devices[device].mem_size : len;
-		memcpy((void *)mem_addr, buf, count);
-		len -= count;
-		buf += count;
+		wait_free(flag_addr);
+		count = stream_get(&s, (void *)mem_addr,
+				my_devices[device].mem_size);
+		if (!count)
+			break;
 		*count_addr = count;
 		*flag_addr = PLAT_IO_DATA_READY;
+		stream_progress(&s, count, quiet);
 	}
 
-	return 0;
+	return stream_close(&s, quiet);
 }
-
@@ -0,0 +1,230 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "load.h"
+
+#define READ_SIZE	(1 << 16)
+
+/*
+ * Checks what load-data sent against what came out the other end. Each
+ * stream has to arrive in order, without holes, repeats or damaged
+ * payload. Bytes that are not a message are skipped up to the next magic.
+ */
+struct verify_stream {
+	uint8_t *seen; /*Bitmap by seq */
+	uint64_t seen_size;
+	uint64_t next;
+	uint64_t msgs;
+	uint64_t gaps;
+	uint64_t reordered;
+	uint64_t dups;
+	uint64_t corrupt;
+	uint64_t logged;
+	uint64_t missing;
+};
+
+static struct verify_stream streams[LOAD_MAX_STREAMS];
+static uint64_t skipped;
+
+int usage(char **argv)
+{
+	printf("Program checks a capture of load-data messages\n");
+	printf("Usage: %s [-l <log>] [-t <seconds>] <capture>\n", argv[0]);
+	printf("  -l  load-data -o log, everything in it has to show up\n");
+	printf("  -t  Stop reading after this long, for devices\n");
+	printf("<capture> is a file, a device or - for stdin\n");
+	printf("Prints a JSON summary, exits with an error on any problem\n");
+	return -1;
+}
+
+//Marks seq as seen, returns 1 if it already was
+static int verify_mark(struct verify_stream *s, uint64_t seq)
+{
+	uint64_t size;
+	uint8_t *seen;
+	int was;
+
+	if (seq / 8 >= s->seen_size) {
+		size = s->seen_size ? s->seen_size : 4096;
+		while (seq / 8 >= size)
+			size *= 2;
+		seen = realloc(s->seen, size);
+		if (!seen) {
+			printf("ERROR: Out of memory");
+			exit(-1);
+		}
+		memset(seen + s->seen_size, 0, size - s->seen_size);
+		s->seen = seen;
+		s->seen_size = size;
+	}
+	was = s->seen[seq / 8] & (1 << (seq % 8));
+	s->seen[seq / 8] |= 1 << (seq % 8);
+	return !!was;
+}
+
+static void verify_msg(const uint8_t *msg, unsigned int stream, uint64_t seq,
+		uint16_t len)
+{
+	struct verify_stream *s = &streams[stream];
+
+	s->msgs++;
+	if (load_check(msg, stream, seq, len) != len)
+		s->corrupt++;
+	if (verify_mark(s, seq)) {
+		s->dups++;
+		return;
+	}
+	if (seq > s->next)
+		s->gaps++;
+	else if (seq < s->next)
+		s->reordered++;
+	if (seq >= s->next)
+		s->next = seq + 1;
+}
+
+//Eats whole messages from buf, returns how many bytes it used
+static size_t verify_buf(const uint8_t *buf, size_t len)
+{
+	struct load_hdr hdr;
+	size_t off = 0;
+	uint16_t mlen;
+
+	while (len - off >= sizeof(hdr)) {
+		memcpy(&hdr, buf + off, sizeof(hdr));
+		mlen = le16toh(hdr.len);
+		if (le32toh(hdr.magic) != LOAD_MAGIC ||
+				le16toh(hdr.stream) >= LOAD_MAX_STREAMS ||
+				mlen < sizeof(hdr)) {
+			skipped++;
+			off++;
+			continue;
+		}
+		if (len - off < mlen)
+			break;
+		verify_msg(buf + off, le16toh(hdr.stream), le64toh(hdr.seq),
+				mlen);
+		off += mlen;
+	}
+	return off;
+}
+
+static int verify_log(const char *path)
+{
+	unsigned long long seq, ns;
+	unsigned int stream, len;
+	struct verify_stream *s;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("fopen error (%s)\n", path);
+		return -1;
+	}
+	while (fscanf(f, "%u,%llu,%u,%llu", &stream, &seq, &len, &ns) == 4) {
+		if (stream >= LOAD_MAX_STREAMS)
+			continue;
+		s = &streams[stream];
+		s->logged++;
+		if (seq / 8 >= s->seen_size ||
+				!(s->seen[seq / 8] & (1 << (seq % 8))))
+			s->missing++;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void on_alarm(int sig)
+{
+}
+
+int main(int argc, char **argv)
+{
+	const char *log = NULL;
+	uint64_t total = 0, bad = 0;
+	size_t len = 0, used;
+	struct sigaction sa;
+	unsigned int i, seconds = 0;
+	uint8_t *buf;
+	ssize_t ret;
+	int fd, opt, first = 1;
+
+	while ((opt = getopt(argc, argv, "l:t:")) != -1) {
+		switch (opt) {
+		case 'l': log = optarg; break;
+		case 't': seconds = atoi(optarg); break;
+		default: return usage(argv);
+		}
+	}
+	if (optind != argc - 1)
+		return usage(argv);
+
+	buf = malloc(READ_SIZE + LOAD_MAX_LEN);
+	if (!buf) {
+		printf("ERROR: Out of memory");
+		return -1;
+	}
+	fd = strcmp(argv[optind], "-") ? open(argv[optind], O_RDONLY) : 0;
+	if (fd < 0) {
+		printf("file open error %s\n", argv[optind]);
+		return -1;
+	}
+
+	//Devices never hit EOF, the alarm gets read() out of the driver
+	if (seconds) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_alarm;
+		sigaction(SIGALRM, &sa, NULL);
+		alarm(seconds);
+	}
+
+	for (;;) {
+		ret = read(fd, buf + len, READ_SIZE);
+		if (ret <= 0)
+			break;
+		len += ret;
+		used = verify_buf(buf, len);
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+	if (ret < 0 && errno != EINTR) {
+		printf("read error %s\n", argv[optind]);
+		return -1;
+	}
+	skipped += len;
+
+	if (log && verify_log(log))
+		return -1;
+
+	printf("{\"streams\":[");
+	for (i = 0; i < LOAD_MAX_STREAMS; i++) {
+		struct verify_stream *s = &streams[i];
+
+		if (!s->msgs && !s->logged)
+			continue;
+		printf("%s{\"id\":%u,\"msgs\":%llu,\"gaps\":%llu,"
+				"\"reordered\":%llu,\"dups\":%llu,"
+				"\"corrupt\":%llu,\"logged\":%llu,\"missing\":%llu}",
+				first ? "" : ",", i, (unsigned long long)s->msgs,
+				(unsigned long long)s->gaps,
+				(unsigned long long)s->reordered,
+				(unsigned long long)s->dups,
+				(unsigned long long)s->corrupt,
+				(unsigned long long)s->logged,
+				(unsigned long long)s->missing);
+		first = 0;
+		total += s->msgs;
+		bad += s->gaps + s->reordered + s->dups + s->corrupt +
+			s->missing;
+	}
+	printf("],\"msgs\":%llu,\"skipped_bytes\":%llu,\"ok\":%s}\n",
+			(unsigned long long)total, (unsigned long long)skipped,
+			bad || skipped ? "false" : "true");
+
+	return bad || skipped ? -1 : 0;
+}
@@ -5,16 +5,30 @@
 #include <linux/ktime.h>
 #include <linux/init.h>
 #include <linux/io.h>
+#include <linux/debugfs.h>
+#include <linux/relay.h>
+#include <linux/uaccess.h>
 
 
 #define DRV_NAME "ddone_device"
 
-static dma_addr_t mem_base = 0x60000000;
-static dma_addr_t reg_base = 0x60001000;
-
 #define MEM_SIZE (4096)
 #define REG_SIZE (8)
 #define POLL_TIME_MS (500)
+#define MAX_WINDOWS (16)
+
+//One platform device per mem_base/reg_base pair
+static unsigned long mem_base[MAX_WINDOWS] = { 0x60000000 };
+static unsigned long reg_base[MAX_WINDOWS] = { 0x60001000 };
+static int nr_mem = 1, nr_reg = 1;
+module_param_array(mem_base, ulong, &nr_mem, 0444);
+MODULE_PARM_DESC(mem_base, "Physical addresses of the data windows");
+module_param_array(reg_base, ulong, &nr_reg, 0444);
+MODULE_PARM_DESC(reg_base, "Physical addresses of their registers");
+
+static unsigned int poll_ms = POLL_TIME_MS;
+module_param(poll_ms, uint, 0644);
+MODULE_PARM_DESC(poll_ms, "Time between scans of all windows");
 
 
 #define SIZE_REG_OFFSET (4)
@@ -22,40 +36,173 @@ static dma_addr_t reg_base = 0x60001000;
 #define DATA_READY (1)
 #define MAX_WORK_THREADS (1)
 
+static unsigned int subbuf_size = 256 * 1024;
+module_param(subbuf_size, uint, 0444);
+MODULE_PARM_DESC(subbuf_size, "Relay sub-buffer size, at least one chunk");
+
+static unsigned int n_subbufs = 8;
+module_param(n_subbufs, uint, 0444);
+MODULE_PARM_DESC(n_subbufs, "Relay sub-buffers per CPU");
+
+static bool tap;
+module_param(tap, bool, 0444);
+MODULE_PARM_DESC(tap, "Only copy chunks, leave the window to its reader");
+
 static void ddone_driver_work(struct work_struct *work);
 
+/*
+ * Each chunk goes to the relay buffer of the CPU the work ran on as this
+ * header followed by size bytes of the window. Readers mmap or read
+ * <debugfs>/ddone_tap/<device>/chunk<cpu>. read() frees sub-buffers as it
+ * goes, an mmap reader writes "<cpu> <n>" to consumed once it is done with
+ * n more sub-buffers of that CPU, or the channel fills and drops.
+ */
+struct ddone_tap_rec {
+	u64 ts;//CLOCK_MONOTONIC ns when the chunk was seen
+	u32 size;
+	u32 flags;
+};
+
 struct ddone_device {
 	void __iomem *mem;
 	void __iomem *regs;
-	struct delayed_work dwork;
-	struct workqueue_struct *data_read_wq;
-	u64 poll_time;
+	struct list_head node;
+	struct dentry *dir;
+	struct rchan *chan;
+	u32 flag;
+	u32 last_flag;//Tap mode records a chunk when DATA_READY comes up
+	//Only the work writes to the channel, so plain counters do
+	u64 chunks;
+	u64 dropped;
 };
 
-struct platform_device *pdev;
+static struct platform_device *pdevs[MAX_WINDOWS];
+static struct dentry *ddone_tap_root;
+
+//Probed windows, all scanned by the one poll work
+static LIST_HEAD(ddone_devices);
+static DEFINE_MUTEX(ddone_devices_lock);
+static struct workqueue_struct *ddone_poll_wq;
+static DECLARE_DELAYED_WORK(ddone_poll_work, ddone_driver_work);
 
-static u32 ddone_device_read_mem8(struct ddone_device *dev, u32 offset)
-{
-	return ioread8(dev->mem + offset);
-}
 static u32 ddone_device_read_reg32(struct ddone_device *dev, u32 offset)
 {
-	u32 data = ioread32(dev->regs + offset);
-
-	pr_info("Reading reg offset %p data %u", dev->regs + offset, data);
-	return data;
+	return ioread32(dev->regs + offset);
 }
 static void ddone_device_write_reg32(struct ddone_device *dev, u32 offset, u32 val)
 {
 	iowrite32(val, dev->regs+offset);
 }
 
+//No overwriting, a chunk that does not fit is dropped and counted
+static int ddone_tap_subbuf_start(struct rchan_buf *buf, void *subbuf,
+		void *prev_subbuf, size_t prev_padding)
+{
+	struct ddone_device *my_dev = buf->chan->private_data;
+
+	if (relay_buf_full(buf)) {
+		my_dev->dropped++;
+		return 0;
+	}
+	return 1;
+}
+
+static struct dentry *ddone_tap_create_buf_file(const char *filename,
+		struct dentry *parent, umode_t mode, struct rchan_buf *buf,
+		int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+			&relay_file_operations);
+}
+
+static int ddone_tap_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static ssize_t ddone_tap_consumed_write(struct file *file,
+		const char __user *ubuf, size_t len, loff_t *ppos)
+{
+	struct ddone_device *my_dev = file->private_data;
+	unsigned int cpu;
+	size_t n;
+	char kbuf[32];
+
+	if (len >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, ubuf, len))
+		return -EFAULT;
+	kbuf[len] = '\0';
+	if (sscanf(kbuf, "%u %zu", &cpu, &n) != 2 || cpu >= nr_cpu_ids ||
+			!cpu_possible(cpu) || n > n_subbufs)
+		return -EINVAL;
+	relay_subbufs_consumed(my_dev->chan, cpu, n);
+	return len;
+}
+
+static const struct file_operations ddone_tap_consumed_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = ddone_tap_consumed_write,
+	.llseek = noop_llseek,
+};
+
+static const struct rchan_callbacks ddone_tap_callbacks = {
+	.subbuf_start = ddone_tap_subbuf_start,
+	.create_buf_file = ddone_tap_create_buf_file,
+	.remove_buf_file = ddone_tap_remove_buf_file,
+};
+
+static int ddone_tap_open(struct ddone_device *my_dev, struct device *dev)
+{
+	if (subbuf_size < sizeof(struct ddone_tap_rec) + MEM_SIZE)
+		return -EINVAL;
+
+	my_dev->dir = debugfs_create_dir(dev_name(dev), ddone_tap_root);
+	my_dev->chan = relay_open("chunk", my_dev->dir, subbuf_size,
+			n_subbufs, &ddone_tap_callbacks, my_dev);
+	if (!my_dev->chan) {
+		debugfs_remove_recursive(my_dev->dir);
+		return -ENOMEM;
+	}
+	debugfs_create_u64("chunks", 0444, my_dev->dir, &my_dev->chunks);
+	debugfs_create_u64("dropped", 0444, my_dev->dir, &my_dev->dropped);
+	debugfs_create_file("consumed", 0200, my_dev->dir, my_dev,
+			&ddone_tap_consumed_fops);
+	return 0;
+}
+
+static void ddone_tap_close(struct ddone_device *my_dev)
+{
+	relay_close(my_dev->chan);
+	debugfs_remove_recursive(my_dev->dir);
+}
+
+//Copies the window straight into the relay buffer, no bounce
+static void ddone_tap_chunk(struct ddone_device *my_dev, u32 flag, u32 size)
+{
+	struct ddone_tap_rec *rec;
+
+	//relay_reserve() works on this CPU's buffer
+	preempt_disable();
+	rec = relay_reserve(my_dev->chan, sizeof(*rec) + size);
+	if (rec) {
+		rec->ts = ktime_get_ns();
+		rec->size = size;
+		rec->flags = flag;
+		memcpy_fromio(rec + 1, my_dev->mem, size);
+		my_dev->chunks++;
+	}
+	preempt_enable();
+}
 
 static int ddone_device_probe(struct platform_device *pdev)
 {
 	struct device *dev;
 	struct ddone_device *my_dev;
 	struct resource *res;
+	int err;
 
 	dev = &pdev->dev;
 	my_dev = devm_kzalloc(dev, sizeof(struct ddone_device), GFP_KERNEL);
@@ -77,15 +224,13 @@ static int ddone_device_probe(struct platform_device *pdev)
 	pr_info("Memory mapped to %p\n", my_dev->regs);
 	pr_info("Registers mapped to %p\n", my_dev->mem);
 
-	my_dev->data_read_wq = alloc_workqueue("ddone_driver_read", WQ_UNBOUND, MAX_WORK_THREADS);
-	if (!my_dev->data_read_wq)
-		return -ENOMEM;
-
-	INIT_DELAYED_WORK(&my_dev->dwork, ddone_driver_work);
-
-	my_dev->poll_time = msecs_to_jiffies(POLL_TIME_MS);
+	err = ddone_tap_open(my_dev, dev);
+	if (err)
+		return err;
 
-	queue_delayed_work(my_dev->data_read_wq, &my_dev->dwork, 0);
+	mutex_lock(&ddone_devices_lock);
+	list_add_tail(&my_dev->node, &ddone_devices);
+	mutex_unlock(&ddone_devices_lock);
 
 	return 0;
 
@@ -98,12 +243,14 @@ static int ddone_device_remove(struct platform_device *pdev)
 
 	struct ddone_device *dev = platform_get_drvdata(pdev);
 
-	if (dev->data_read_wq) {
-		cancel_delayed_work_sync(&(dev->dwork));
-		destroy_workqueue(dev->data_read_wq);
-	}
+	//The scan holds the lock, so it is done with this window after this
+	mutex_lock(&ddone_devices_lock);
+	list_del(&dev->node);
+	mutex_unlock(&ddone_devices_lock);
 
-	pr_info("Platform device workqueue stopped");
+	pr_info("Tapped %llu chunks, dropped %llu\n", dev->chunks,
+			dev->dropped);
+	ddone_tap_close(dev);
 
 	return 0;
 
@@ -141,54 +288,56 @@ static void ddone_driver_unregister(void)
 
 static void ddone_driver_work(struct work_struct *work)
 {
-
-
-	struct ddone_device *my_dev = container_of(work, struct ddone_device, dwork.work);
-
-	u32 flag, size, i;
-
-	flag = ddone_device_read_reg32(my_dev, FLAG_REG_OFFSET);
-	if (flag & DATA_READY) {
-		size = ddone_device_read_reg32(my_dev, SIZE_REG_OFFSET);
-		if (size > MEM_SIZE)
-			size = MEM_SIZE;
-		for (i = 0; i < size; i++) {
-			u8 data = ddone_device_read_mem8(my_dev, i);
-
-			pr_err("MEM[%u] = 0x%x", i, data);
+	struct ddone_device *my_dev;
+	u32 size;
+
+	mutex_lock(&ddone_devices_lock);
+	//All FLAGS registers first, a slow copy does not delay seeing the rest
+	list_for_each_entry(my_dev, &ddone_devices, node)
+		my_dev->flag = ddone_device_read_reg32(my_dev, FLAG_REG_OFFSET);
+	rmb();
+
+	list_for_each_entry(my_dev, &ddone_devices, node) {
+		//A tap sees the same chunk until its reader takes it
+		if ((my_dev->flag & DATA_READY) &&
+				!(tap && (my_dev->last_flag & DATA_READY))) {
+			size = ddone_device_read_reg32(my_dev, SIZE_REG_OFFSET);
+			if (size > MEM_SIZE)
+				size = MEM_SIZE;
+			ddone_tap_chunk(my_dev, my_dev->flag, size);
+
+			if (!tap)
+				ddone_device_write_reg32(my_dev, FLAG_REG_OFFSET,
+						my_dev->flag & ~DATA_READY);
 		}
-
-		rmb();
-		flag &= ~DATA_READY;
-		ddone_device_write_reg32(my_dev, FLAG_REG_OFFSET, flag);
+		my_dev->last_flag = my_dev->flag;
 	}
+	mutex_unlock(&ddone_devices_lock);
 
-
-	queue_delayed_work(my_dev->data_read_wq, &my_dev->dwork, my_dev->poll_time);
-
-
+	queue_delayed_work(ddone_poll_wq, &ddone_poll_work,
+			msecs_to_jiffies(max(READ_ONCE(poll_ms), 1U)));
 }
 
-
-static int __init ddone_device_add(void)
+static struct platform_device *__init ddone_device_add(unsigned int id)
 {
 	struct resource res[2] = {
 	{
-		.start = mem_base,
-		.end = mem_base + MEM_SIZE - 1,
+		.start = mem_base[id],
+		.end = mem_base[id] + MEM_SIZE - 1,
 		.name = "ddone_mem",
 		.flags = IORESOURCE_MEM
 		}, {
-		.start = reg_base,
-		.end = reg_base + REG_SIZE - 1,
+		.start = reg_base[id],
+		.end = reg_base[id] + REG_SIZE - 1,
 		.name = "ddone_regs",
 		.flags = IORESOURCE_MEM
 
 	}
 	};
+	struct platform_device *pdev;
 	int err = 0;
 
-	pdev = platform_device_alloc(DRV_NAME, res[0].start);
+	pdev = platform_device_alloc(DRV_NAME, id);
 	if (!pdev) {
 		err = -ENOMEM;
 		pr_err("Failed to allocate device");
@@ -210,28 +359,67 @@ static int __init ddone_device_add(void)
 
 	pr_info("Platform device added\n");
 
-	return 0;
+	return pdev;
 exit_free:
 	platform_device_put(pdev);
 exit:
-	return err;
+	return ERR_PTR(err);
 }
 
 
 
 int __init my_init_module(void)
 {
-	int res = ddone_driver_register();
+	unsigned int i;
+	int err;
+
+	if (nr_mem != nr_reg) {
+		pr_err("Need a reg_base for every mem_base\n");
+		return -EINVAL;
+	}
 
-	res  = ddone_device_add();
+	ddone_tap_root = debugfs_create_dir("ddone_tap", NULL);
+	err = ddone_driver_register();
+	if (err)
+		goto err_debugfs;
 
-	return res;
+	for (i = 0; i < nr_mem; i++) {
+		pdevs[i] = ddone_device_add(i);
+		if (IS_ERR(pdevs[i])) {
+			err = PTR_ERR(pdevs[i]);
+			goto err_devices;
+		}
+	}
+
+	ddone_poll_wq = alloc_workqueue("ddone_driver_read", WQ_UNBOUND,
+			MAX_WORK_THREADS);
+	if (!ddone_poll_wq) {
+		err = -ENOMEM;
+		goto err_devices;
+	}
+	queue_delayed_work(ddone_poll_wq, &ddone_poll_work, 0);
+
+	return 0;
+
+err_devices:
+	while (i--)
+		platform_device_unregister(pdevs[i]);
+	ddone_driver_unregister();
+err_debugfs:
+	debugfs_remove_recursive(ddone_tap_root);
+	return err;
 }
 
 void __exit my_exit_module(void)
 {
-	platform_device_unregister(pdev);
+	unsigned int i;
+
+	cancel_delayed_work_sync(&ddone_poll_work);
+	destroy_workqueue(ddone_poll_wq);
+	for (i = 0; i < nr_mem; i++)
+		platform_device_unregister(pdevs[i]);
 	ddone_driver_unregister();
+	debugfs_remove_recursive(ddone_tap_root);
 }
 
 module_init(my_init_module);
@@ -6,6 +6,18 @@
 #include <linux/wait.h>
 #include <linux/jiffies.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+#include <linux/kernel_stat.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
 #include <linux/errno.h>
 
 
@@ -14,38 +26,404 @@ MODULE_AUTHOR("Mykyta Poturai <mykyta.poturai@globallogic.com");
 MODULE_DESCRIPTION("Timer testing module");
 MODULE_LICENSE("Dual BSD/GPL");
 
+/*
+ * Wakeup jitter of the ways a driver can poll, to pick one per board.
+ * Every backend wakes up count times with the same period and re-arms
+ * against an absolute schedule. Jitter is how far each interval between
+ * two wakeups is off the period the backend really got, which for the
+ * jiffy based ones is period_us rounded up to whole jiffies.
+ *
+ * echo all > /sys/kernel/debug/timer_bench/run (or a backend name) runs
+ * them one after another, then <name>/stats and <name>/hist have the
+ * results. hist is "<from_ns> <count>" per power of two bucket. sys_ns is
+ * the system, irq and softirq time of all CPUs during the run per wakeup,
+ * so only meaningful on an otherwise idle board.
+ */
 
-static unsigned long delay ;
-static struct timer_list* timer;
+static unsigned int period_us = 1000;
+module_param(period_us, uint, 0644);
+MODULE_PARM_DESC(period_us, "Wakeup period of every backend");
 
-void timer_fn(struct timer_list* arg){
+static unsigned int count = 1000;
+module_param(count, uint, 0644);
+MODULE_PARM_DESC(count, "Measured wakeups per backend");
 
-    pr_err("Timer fired");
+static bool kthread_fifo;
+module_param(kthread_fifo, bool, 0644);
+MODULE_PARM_DESC(kthread_fifo, "Run the kthread backend as SCHED_FIFO");
 
-    mod_timer(arg, jiffies+delay);
+#define TB_BUCKETS (40)
+
+enum tb_kind {
+	TB_TIMER,
+	TB_HRTIMER,
+	TB_WQ,
+	TB_KTHREAD,
+};
+
+struct tb_backend {
+	const char *name;
+	enum tb_kind kind;
+	unsigned int wq_flags;
+
+	struct timer_list timer;
+	struct hrtimer hrtimer;
+	struct delayed_work dwork;
+	struct workqueue_struct *wq;
+	struct task_struct *task;
+	struct completion done;
+	unsigned long period_j;
+	unsigned long next;//Jiffy the next wakeup is due
+	bool started;
+	u64 last_ns;
+
+	u64 period_ns;
+	unsigned int samples;
+	unsigned int want;
+	u64 hist[TB_BUCKETS];
+	u64 min_ns;
+	u64 max_ns;
+	u64 sum_ns;
+	u64 late;
+	u64 cb_ns;
+	u64 sys_ns;
+	u64 run_ns;
+};
+
+static struct tb_backend tb_backends[] = {
+	{ .name = "timer", .kind = TB_TIMER },
+	{ .name = "hrtimer", .kind = TB_HRTIMER },
+	{ .name = "wq_bound", .kind = TB_WQ, .wq_flags = 0 },
+	{ .name = "wq_unbound", .kind = TB_WQ, .wq_flags = WQ_UNBOUND },
+	{ .name = "wq_highpri", .kind = TB_WQ, .wq_flags = WQ_HIGHPRI },
+	{ .name = "kthread", .kind = TB_KTHREAD },
+};
+
+//Held for a whole run, so results are never read half written
+static DEFINE_MUTEX(tb_lock);
+static struct dentry *tb_root;
+
+static u64 tb_sys_ns(void)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		sum += kcpustat_cpu(cpu).cpustat[CPUTIME_SYSTEM];
+		sum += kcpustat_cpu(cpu).cpustat[CPUTIME_IRQ];
+		sum += kcpustat_cpu(cpu).cpustat[CPUTIME_SOFTIRQ];
+	}
+	return sum;
 }
 
-static int __init hello_init(void)
+//Records a wakeup at now, returns false once the run has enough of them
+static bool tb_sample(struct tb_backend *b, u64 now)
+{
+	s64 d;
+	u64 jitter;
+	unsigned int i;
+
+	if (b->started) {
+		d = now - b->last_ns - b->period_ns;
+		if (d > 0)
+			b->late++;
+		jitter = d < 0 ? -d : d;
+
+		i = min_t(unsigned int, fls64(jitter), TB_BUCKETS - 1);
+		b->hist[i]++;
+		b->min_ns = min(b->min_ns, jitter);
+		b->max_ns = max(b->max_ns, jitter);
+		b->sum_ns += jitter;
+		b->samples++;
+	}
+	b->started = true;
+	b->last_ns = now;
+
+	if (b->samples < b->want)
+		return true;
+	complete(&b->done);
+	return false;
+}
+
+static void tb_timer_fn(struct timer_list *t)
+{
+	struct tb_backend *b = from_timer(b, t, timer);
+	u64 now = ktime_get_ns();
+
+	if (tb_sample(b, now)) {
+		b->next += b->period_j;
+		mod_timer(&b->timer, b->next);
+	}
+	b->cb_ns += ktime_get_ns() - now;
+}
+
+static enum hrtimer_restart tb_hrtimer_fn(struct hrtimer *t)
+{
+	struct tb_backend *b = container_of(t, struct tb_backend, hrtimer);
+	u64 now = ktime_get_ns();
+	bool again;
+
+	again = tb_sample(b, now);
+	if (again)
+		hrtimer_forward_now(t, ns_to_ktime(b->period_ns));
+	b->cb_ns += ktime_get_ns() - now;
+
+	return again ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+static void tb_work_fn(struct work_struct *work)
+{
+	struct tb_backend *b = container_of(to_delayed_work(work),
+			struct tb_backend, dwork);
+	u64 now = ktime_get_ns();
+	unsigned long delay = 0;
+
+	if (tb_sample(b, now)) {
+		b->next += b->period_j;
+		if (time_after(b->next, jiffies))
+			delay = b->next - jiffies;
+		queue_delayed_work(b->wq, &b->dwork, delay);
+	}
+	b->cb_ns += ktime_get_ns() - now;
+}
+
+static int tb_kthread_fn(void *data)
+{
+	struct tb_backend *b = data;
+	ktime_t deadline = ktime_get();
+	u64 now;
+	bool again = true;
+
+	while (again && !kthread_should_stop()) {
+		deadline = ktime_add_ns(deadline, b->period_ns);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS);
+
+		now = ktime_get_ns();
+		again = tb_sample(b, now);
+		b->cb_ns += ktime_get_ns() - now;
+	}
+
+	//kthread_stop() needs the thread to still be there
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int tb_start(struct tb_backend *b)
 {
-    delay = msecs_to_jiffies(1000);
-    
-    timer = (struct timer_list*)kmalloc(sizeof(struct timer_list),GFP_KERNEL);
-    if(!timer) return -ENOMEM;
-    timer->expires = jiffies+delay;
+	switch (b->kind) {
+	case TB_TIMER:
+		timer_setup(&b->timer, tb_timer_fn, 0);
+		b->next = jiffies + b->period_j;
+		mod_timer(&b->timer, b->next);
+		break;
+	case TB_HRTIMER:
+		hrtimer_init(&b->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		b->hrtimer.function = tb_hrtimer_fn;
+		hrtimer_start(&b->hrtimer, ns_to_ktime(b->period_ns),
+				HRTIMER_MODE_REL);
+		break;
+	case TB_WQ:
+		b->wq = alloc_workqueue("timer_bench_%s", b->wq_flags, 1,
+				b->name);
+		if (!b->wq)
+			return -ENOMEM;
+		INIT_DELAYED_WORK(&b->dwork, tb_work_fn);
+		b->next = jiffies + b->period_j;
+		queue_delayed_work(b->wq, &b->dwork, b->period_j);
+		break;
+	case TB_KTHREAD:
+		b->task = kthread_create(tb_kthread_fn, b, "timer_bench");
+		if (IS_ERR(b->task))
+			return PTR_ERR(b->task);
+		if (kthread_fifo)
+			sched_set_fifo(b->task);
+		wake_up_process(b->task);
+		break;
+	}
+	return 0;
+}
+
+static void tb_stop(struct tb_backend *b)
+{
+	switch (b->kind) {
+	case TB_TIMER:
+		del_timer_sync(&b->timer);
+		break;
+	case TB_HRTIMER:
+		hrtimer_cancel(&b->hrtimer);
+		break;
+	case TB_WQ:
+		cancel_delayed_work_sync(&b->dwork);
+		destroy_workqueue(b->wq);
+		b->wq = NULL;
+		break;
+	case TB_KTHREAD:
+		kthread_stop(b->task);
+		b->task = NULL;
+		break;
+	}
+}
+
+static int tb_run(struct tb_backend *b)
+{
+	u64 t0, sys0;
+	int err;
+
+	memset(b->hist, 0, sizeof(b->hist));
+	b->min_ns = U64_MAX;
+	b->max_ns = 0;
+	b->sum_ns = 0;
+	b->late = 0;
+	b->cb_ns = 0;
+	b->samples = 0;
+	b->started = false;
+	b->want = max(count, 1U);
+	init_completion(&b->done);
+
+	b->period_j = max(usecs_to_jiffies(period_us), 1UL);
+	if (b->kind == TB_TIMER || b->kind == TB_WQ)
+		b->period_ns = jiffies_to_nsecs(b->period_j);
+	else
+		b->period_ns = (u64)max(period_us, 1U) * NSEC_PER_USEC;
+
+	sys0 = tb_sys_ns();
+	t0 = ktime_get_ns();
+	err = tb_start(b);
+	if (err)
+		return err;
+
+	err = wait_for_completion_interruptible(&b->done);
+	tb_stop(b);
+	b->run_ns = ktime_get_ns() - t0;
+	b->sys_ns = tb_sys_ns() - sys0;
+
+	pr_info("%s: %u wakeups, jitter mean %llu ns max %llu ns\n", b->name,
+			b->samples,
+			b->samples ? div_u64(b->sum_ns, b->samples) : 0,
+			b->max_ns);
+
+	return err;
+}
+
+static int tb_stats_show(struct seq_file *s, void *unused)
+{
+	struct tb_backend *b = s->private;
+	unsigned int n;
+	int err;
+
+	err = mutex_lock_interruptible(&tb_lock);
+	if (err)
+		return err;
+
+	n = max(b->samples, 1U);
+	seq_printf(s, "period_ns %llu\n", b->period_ns);
+	seq_printf(s, "samples %u\n", b->samples);
+	seq_printf(s, "min_ns %llu\n", b->samples ? b->min_ns : 0);
+	seq_printf(s, "mean_ns %llu\n", div_u64(b->sum_ns, n));
+	seq_printf(s, "max_ns %llu\n", b->max_ns);
+	seq_printf(s, "late %llu\n", b->late);
+	seq_printf(s, "cb_ns %llu\n", div_u64(b->cb_ns, n));
+	seq_printf(s, "sys_ns %llu\n", div_u64(b->sys_ns, n));
+	seq_printf(s, "run_ns %llu\n", b->run_ns);
+
+	mutex_unlock(&tb_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tb_stats);
+
+static int tb_hist_show(struct seq_file *s, void *unused)
+{
+	struct tb_backend *b = s->private;
+	int i, last = -1;
+	int err;
+
+	err = mutex_lock_interruptible(&tb_lock);
+	if (err)
+		return err;
+
+	for (i = 0; i < TB_BUCKETS; i++) {
+		if (b->hist[i])
+			last = i;
+	}
+	//Bucket i holds jitter below 2^i ns
+	for (i = 0; i <= last; i++)
+		seq_printf(s, "%llu %llu\n", i ? 1ULL << (i - 1) : 0,
+				b->hist[i]);
+
+	mutex_unlock(&tb_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tb_hist);
+
+static ssize_t tb_run_write(struct file *file, const char __user *ubuf,
+		size_t len, loff_t *ppos)
+{
+	char buf[32];
+	char *name;
+	bool all, found = false;
+	int i, err = 0;
 
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	name = strim(buf);
+	all = !strcmp(name, "all");
+
+	err = mutex_lock_interruptible(&tb_lock);
+	if (err)
+		return err;
+
+	for (i = 0; i < ARRAY_SIZE(tb_backends) && !err; i++) {
+		if (!all && strcmp(name, tb_backends[i].name))
+			continue;
+		found = true;
+		err = tb_run(&tb_backends[i]);
+	}
+
+	mutex_unlock(&tb_lock);
+
+	if (!found)
+		return -EINVAL;
+	return err ? err : len;
+}
+
+static const struct file_operations tb_run_fops = {
+	.owner = THIS_MODULE,
+	.write = tb_run_write,
+};
+
+static int __init hello_init(void)
+{
+	struct dentry *dir;
+	int i;
 
-    timer_setup(timer,timer_fn,0);
-    add_timer(timer);
+	tb_root = debugfs_create_dir("timer_bench", NULL);
+	debugfs_create_file("run", 0200, tb_root, NULL, &tb_run_fops);
 
+	for (i = 0; i < ARRAY_SIZE(tb_backends); i++) {
+		dir = debugfs_create_dir(tb_backends[i].name, tb_root);
+		debugfs_create_file("stats", 0444, dir, &tb_backends[i],
+				&tb_stats_fops);
+		debugfs_create_file("hist", 0444, dir, &tb_backends[i],
+				&tb_hist_fops);
+	}
 
-    return 0;
+	return 0;
 
 }
 
 static void __exit hello_exit(void)
 {
-    del_timer(timer);
-    kfree(timer);
+	debugfs_remove_recursive(tb_root);
 }
 
 module_init(hello_init);